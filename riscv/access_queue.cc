@@ -0,0 +1,99 @@
+// See LICENSE for license details.
+
+#include "access_queue.h"
+#include <algorithm>
+#include <sched.h>
+#include <string.h>
+
+// how often the consumer looks again at an empty queue before it sleeps;
+// the mmus hand over their accesses a step at a time, so more are usually
+// on their way
+static const int CONSUMER_SPINS = 1000;
+
+access_queue_t::access_queue_t()
+  : ring(new mem_event_t[ENTRIES]), head(0), tail(0), sleeping(false),
+    stopping(false), consumer(&access_queue_t::consume, this)
+{
+}
+
+access_queue_t::~access_queue_t()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_one();
+  consumer.join();
+}
+
+void access_queue_t::trace(uint64_t addr, size_t bytes, bool store, bool fetch)
+{
+  mem_event_t e = {addr, (uint32_t)bytes, store, fetch};
+  trace(&e, 1);
+}
+
+void access_queue_t::trace(const mem_event_t* events, size_t n)
+{
+  uint64_t t = tail.load(std::memory_order_relaxed);
+  while (n)
+  {
+    uint64_t room;
+    while ((room = ENTRIES - (t - head.load(std::memory_order_acquire))) == 0)
+      sched_yield();
+
+    // up to the end of the ring at most, and around again if need be
+    size_t k = std::min<uint64_t>(std::min<uint64_t>(n, room),
+                                  ENTRIES - t % ENTRIES);
+    memcpy(&ring[t % ENTRIES], events, k * sizeof(mem_event_t));
+    events += k;
+    n -= k;
+    t += k;
+
+    // the consumer publishes that it sleeps before it looks at tail for the
+    // last time, and this reads that after publishing tail, so one of the
+    // two always sees the other
+    tail.store(t, std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_seq_cst))
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      wake.notify_one();
+    }
+  }
+}
+
+void access_queue_t::drain()
+{
+  uint64_t t = tail.load(std::memory_order_relaxed);
+  while (head.load(std::memory_order_acquire) != t)
+    sched_yield();
+}
+
+void access_queue_t::consume()
+{
+  uint64_t h = head.load(std::memory_order_relaxed);
+  while (true)
+  {
+    uint64_t t = tail.load(std::memory_order_acquire);
+    for (int i = 0; t == h && i < CONSUMER_SPINS; i++)
+    {
+      sched_yield();
+      t = tail.load(std::memory_order_acquire);
+    }
+
+    if (t == h)
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      sleeping.store(true, std::memory_order_seq_cst);
+      while ((t = tail.load(std::memory_order_seq_cst)) == h && !stopping)
+        wake.wait(guard);
+      sleeping.store(false, std::memory_order_relaxed);
+      if (t == h)
+        return; // stopping, with everything traced
+    }
+
+    size_t k = std::min<uint64_t>(t - h, ENTRIES - h % ENTRIES);
+    tracers.trace(&ring[h % ENTRIES], k);
+    h += k;
+    head.store(h, std::memory_order_release);
+  }
+}
@@ -0,0 +1,63 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_ACCESS_QUEUE_H
+#define _RISCV_ACCESS_QUEUE_H
+
+#include "memtracer.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// a tracer that queues the accesses it is given and hands them to the
+// tracers hooked to it on a host thread of its own, so cache simulation
+// runs alongside the simulation rather than inside its memory accesses.
+//
+// the queue is a ring with a single producer and a single consumer, and
+// neither takes a lock while the other keeps up. the producer may be the
+// mmu of any hart, but only one at a time, as with any tracer; the hooked
+// tracers see the accesses in the order they were queued, so they end up
+// counting exactly what they would have counted being traced directly.
+class access_queue_t : public memtracer_t
+{
+public:
+  access_queue_t();
+  // waits for everything queued to be traced
+  ~access_queue_t();
+
+  // before the queue is registered with any mmu
+  void hook(memtracer_t* t) { tracers.hook(t); }
+
+  bool interested_in_range(uint64_t begin, uint64_t end, bool store, bool fetch)
+  {
+    return tracers.interested_in_range(begin, end, store, fetch);
+  }
+  size_t fetch_block() { return tracers.fetch_block(); }
+  void trace(uint64_t addr, size_t bytes, bool store, bool fetch);
+  void trace(const mem_event_t* events, size_t n);
+
+  // return once the hooked tracers have seen everything queued so far,
+  // say before their counts are read
+  void drain();
+
+private:
+  static const size_t ENTRIES = 65536; // a power of 2
+
+  memtracer_list_t tracers;
+  std::unique_ptr<mem_event_t[]> ring;
+  // each only ever grows; the entry for n is ring[n % ENTRIES]
+  std::atomic<uint64_t> head; // next to trace, moved by the consumer
+  std::atomic<uint64_t> tail; // next to fill, moved by the producer
+
+  // the consumer sleeps on these when the queue stays empty a while
+  std::mutex lock;
+  std::condition_variable wake;
+  std::atomic<bool> sleeping;
+  bool stopping;
+  std::thread consumer;
+
+  void consume();
+};
+
+#endif
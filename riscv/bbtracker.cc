@@ -4,6 +4,10 @@
 
 bb_tracker_t::bb_tracker_t() {
 
+  /* the table is only allocated once tracking starts, as every processor
+     has a tracker */
+  bb_hash = nullptr;
+
   bb_id = 0;
 
   interval_sum = 0;
@@ -17,7 +21,7 @@ bb_tracker_t::bb_tracker_t() {
 
 bb_tracker_t::~bb_tracker_t() {
   bb_node_ptr tmp = nullptr;
-  for (size_t i = 0; i < bb_size; i++) {
+  for (size_t i = 0; bb_hash != nullptr && i < bb_size; i++) {
     bb_node_ptr curr = bb_hash[i];
 
     while (curr != nullptr) {
@@ -26,16 +30,19 @@ bb_tracker_t::~bb_tracker_t() {
       curr = tmp;
     };
   }
+  free(bb_hash);
   bbtrace.close();
 }
 
 
 void bb_tracker_t::init_bb_tracker(const char *dir_name, const char *out_name) {
-  int64_t i;
-
   /* initialize hash ptr table */
-  for (i = 0; i < bb_size; i++)
-    bb_hash[i] = nullptr;
+  if (bb_hash == nullptr)
+    bb_hash = (bb_node_ptr *) calloc(bb_size, sizeof(bb_node_ptr));
+  if (bb_hash == nullptr) {
+    fprintf(stderr, "SimPoint output error: OUT OF MEMORY\n");
+    exit(1);
+  }
 
   finalname = std::string(dir_name) + "/" + out_name + ".bb.gz";
   bbtrace.open(finalname.c_str());
@@ -158,6 +165,17 @@ bool bb_tracker_t::bb_tracker(uint64_t pc, uint64_t num_inst) {
   return false;
 }
 
+std::vector<uint64_t> bb_tracker_t::get_pcs() {
+  std::vector<uint64_t> pcs(bb_id);
+
+  for (size_t i = 0; bb_hash != nullptr && i < bb_size; i++) {
+    for (bb_node_ptr curr = bb_hash[i]; curr != nullptr; curr = curr->next)
+      pcs[curr->bb_id] = curr->pc;
+  }
+
+  return pcs;
+}
+
 void bb_tracker_t::set_interval_size(uint64_t m_interval_size) {
   interval_size = m_interval_size;
 }
@@ -3,7 +3,8 @@
 
 #include <cinttypes>
 #include <string>
-#include "gzstream.h"
+#include <vector>
+#include "pgzstream.h"
 
 /* Size of basic block hash table. Should be increased for very 
    large programs (greater than 1 million basic blocks) */
@@ -22,13 +23,13 @@ typedef bb_node *bb_node_ptr;
 class bb_tracker_t {
 
 private:
-  bb_node_ptr bb_hash[bb_size];
+  bb_node_ptr *bb_hash; /* bb_size entries, allocated on init */
 
   uint64_t bb_id_pool = bb_size;
   uint64_t bb_id;
 
   std::string finalname;
-  ogzstream bbtrace;
+  opgzstream bbtrace;
 
   uint64_t interval_size;
   uint64_t interval_sum;
@@ -61,6 +62,9 @@ public:
    instruction indexes into the basic block hash, and the counter is incremented
    by the number of instructions in the basic block. Return true on each stats dump. */
   bool bb_tracker(uint64_t m_pc, uint64_t m_num_inst);
+
+  /* The pc of the last instruction of each basic block, by id. */
+  std::vector<uint64_t> get_pcs();
 };
 
 #endif
@@ -100,6 +100,42 @@ void cache_sim_t::print_stats()
   std::cout << "Miss Rate:             " << mr << '%' << std::endl;
 }
 
+cache_sim_t::stats_t cache_sim_t::get_stats()
+{
+  stats_t stats;
+  stats.bytes_read = bytes_read;
+  stats.bytes_written = bytes_written;
+  stats.read_accesses = read_accesses;
+  stats.write_accesses = write_accesses;
+  stats.read_misses = read_misses;
+  stats.write_misses = write_misses;
+  stats.writebacks = writebacks;
+  return stats;
+}
+
+void cache_sim_t::add_stats(const stats_t& stats)
+{
+  bytes_read += stats.bytes_read;
+  bytes_written += stats.bytes_written;
+  read_accesses += stats.read_accesses;
+  write_accesses += stats.write_accesses;
+  read_misses += stats.read_misses;
+  write_misses += stats.write_misses;
+  writebacks += stats.writebacks;
+}
+
+cache_sim_t::stats_t& cache_sim_t::stats_t::operator-=(const stats_t& rhs)
+{
+  bytes_read -= rhs.bytes_read;
+  bytes_written -= rhs.bytes_written;
+  read_accesses -= rhs.read_accesses;
+  write_accesses -= rhs.write_accesses;
+  read_misses -= rhs.read_misses;
+  write_misses -= rhs.write_misses;
+  writebacks -= rhs.writebacks;
+  return *this;
+}
+
 uint64_t* cache_sim_t::check_tag(uint64_t addr)
 {
   size_t idx = (addr >> idx_shift) & (sets-1);
@@ -30,6 +30,25 @@ class cache_sim_t
   void print_stats();
   void set_miss_handler(cache_sim_t* mh) { miss_handler = mh; }
 
+  // the counters print_stats shows
+  struct stats_t
+  {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t read_accesses;
+    uint64_t write_accesses;
+    uint64_t read_misses;
+    uint64_t write_misses;
+    uint64_t writebacks;
+
+    stats_t& operator-=(const stats_t& rhs);
+  };
+  stats_t get_stats();
+  // count what another copy of the cache counted too
+  void add_stats(const stats_t& stats);
+  const std::string& get_name() { return name; }
+  size_t get_line_size() { return linesz; }
+
   static cache_sim_t* construct(const char* config, const char* name);
 
  protected:
@@ -88,6 +107,7 @@ class cache_memtracer_t : public memtracer_t
   {
     cache->set_miss_handler(mh);
   }
+  cache_sim_t* get_cache() { return cache; }
 
  protected:
   cache_sim_t* cache;
@@ -105,6 +125,9 @@ class icache_sim_t : public cache_memtracer_t
   {
     if (fetch) cache->access(addr, bytes, false);
   }
+  // the fetches that stay within a line all hit once the first has
+  // brought it in, so just the first is counted
+  size_t fetch_block() { return cache->get_line_size(); }
 };
 
 class dcache_sim_t : public cache_memtracer_t
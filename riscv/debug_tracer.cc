@@ -1,11 +1,5 @@
 #include "config.h"
 
-#ifdef RISCV_ENABLE_DBG_TRACE
-
-#ifdef RISCV_ENABLE_COMMITLOG
-#error Configure flag --enable-commitlog is conflict with --enable-dbg-trace
-#endif
-
 #include <cstring>
 #include <cassert>
 #include <cinttypes>
@@ -368,5 +362,3 @@ insn_record_t *trace_output_last_n_t::insn_rec_circ_buf_pop() {
 
   return ret_ptr;
 }
-
-#endif /* RISCV_ENABLE_DBG_TRACE */
@@ -3,14 +3,14 @@
 
 #include "config.h"
 
-#ifdef RISCV_ENABLE_DBG_TRACE
 //#define __DBG_TRACE_DEBUG_OUTPUT
 
 #include <cstddef>
 #include <string>
 #include <iostream>
+#include <fstream>
 #include "trap.h"
-#include "gzstream.h"
+#include "pgzstream.h"
 #include "disasm.h"
 #include "processor.h"
 
@@ -88,7 +88,7 @@ private:
 #ifdef __DBG_TRACE_DEBUG_OUTPUT
   std::ofstream m_tr_ostream;
 #else
-  ogzstream m_tr_ostream;
+  opgzstream m_tr_ostream;
 #endif
 };
 
@@ -147,6 +147,9 @@ public:
 
   bool enabled() { return m_enabled; };
 
+  // number the records from seqno on, as if tracing had started earlier
+  void set_seqno(uint64_t seqno) { m_insn_seq = seqno; };
+
   void increment_instret() { ++m_instret; };
 
   const insn_record_t &get_current_insn_info();
@@ -167,6 +170,4 @@ private:
   trace_output_t *m_trace_output;
 };
 
-#endif /* RISCV_ENABLE_DBG_TRACE */
-
 #endif /* __DEBUG_TRACER_H */
@@ -122,61 +122,19 @@ private:
 };
 
 // helpful macros, etc
-#define MMU (*p->get_mmu())
+// register and memory accesses go through insn_policy_t: handlers are
+// instantiated once per policy (insn_template.cc), and everywhere else it
+// names fast_policy_t (processor.h)
+#define MMU insn_policy_t::mmu(p)
 #define STATE (*p->get_state())
-#define RS1 STATE.XPR[insn.rs1()]
-#define RS2 STATE.XPR[insn.rs2()]
-#define WRITE_RD(value) STATE.XPR.write(insn.rd(), value)
-
-#ifdef RISCV_ENABLE_COMMITLOG
-  #undef WRITE_RD 
-  #define WRITE_RD(value) ({ \
-        reg_t wdata = value; /* value is a func with side-effects */ \
-        STATE.log_reg_write = (commit_log_reg_t){insn.rd() << 1, wdata}; \
-        STATE.XPR.write(insn.rd(), wdata); \
-      })
-#endif
-
-#define FRS1 STATE.FPR[insn.rs1()]
-#define FRS2 STATE.FPR[insn.rs2()]
-#define FRS3 STATE.FPR[insn.rs3()]
-#define WRITE_FRD(value) STATE.FPR.write(insn.rd(), value)
- 
-#ifdef RISCV_ENABLE_COMMITLOG
-  #undef WRITE_FRD 
-  #define WRITE_FRD(value) ({ \
-        freg_t wdata = value; /* value is a func with side-effects */ \
-        STATE.log_reg_write = (commit_log_reg_t){(insn.rd() << 1) | 1, wdata}; \
-        STATE.FPR.write(insn.rd(), wdata); \
-      })
-#endif
-
-#ifdef RISCV_ENABLE_DBG_TRACE
-//#undef MMU
-//#define MMU (p->get_dbg_tracer()->m_dummy_mmu)
-
-#undef RS1
-#define RS1 p->rd_xpr(insn.rs1(), RSRC1_OPERAND)
-
-#undef RS2
-#define RS2 p->rd_xpr(insn.rs2(), RSRC2_OPERAND)
-
-#undef WRITE_RD
-#define WRITE_RD(value) p->wr_xpr(insn.rd(), value)
-
-#undef FRS1
-#define FRS1 p->rd_fpr(insn.rs1(), RSRC1_OPERAND)
-
-#undef FRS2
-#define FRS2 p->rd_fpr(insn.rs2(), RSRC2_OPERAND)
-
-#undef FRS3
-#define FRS3 p->rd_fpr(insn.rs3(), RSRC3_OPERAND)
-
-#undef WRITE_FRD
-#define WRITE_FRD(value) p->wr_fpr(insn.rd(), value)
-
-#endif
+#define RS1 insn_policy_t::read_xpr(p, insn.rs1(), RSRC1_OPERAND)
+#define RS2 insn_policy_t::read_xpr(p, insn.rs2(), RSRC2_OPERAND)
+#define WRITE_RD(value) insn_policy_t::write_xpr(p, insn.rd(), value)
+
+#define FRS1 insn_policy_t::read_fpr(p, insn.rs1(), RSRC1_OPERAND)
+#define FRS2 insn_policy_t::read_fpr(p, insn.rs2(), RSRC2_OPERAND)
+#define FRS3 insn_policy_t::read_fpr(p, insn.rs3(), RSRC3_OPERAND)
+#define WRITE_FRD(value) insn_policy_t::write_fpr(p, insn.rd(), value)
 
 #define SHAMT (insn.i_imm() & 0x3F)
 #define BRANCH_TARGET (pc + insn.sb_imm())
@@ -0,0 +1,131 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_DECODE_TABLE_H
+#define _RISCV_DECODE_TABLE_H
+
+#include "decode.h"
+#include <map>
+#include <vector>
+
+// maps instruction bits to the first registered (match, mask) pattern they
+// satisfy. the first level is indexed by the major opcode and funct3; slots
+// whose candidates also differ in funct7 get a second level indexed by it.
+// each slot only lists the patterns that can match there, in priority
+// order, and ends with a catch-all entry holding the fallback value.
+template <class T>
+class decode_table_t
+{
+public:
+  decode_table_t(T fallback) : fallback(fallback) { build(); }
+
+  // patterns added earlier take priority over later ones
+  void add(uint32_t match, uint32_t mask, T value)
+  {
+    patterns.push_back((entry_t){match, mask, value});
+  }
+
+  void clear() { patterns.clear(); }
+
+  // must be called after adding patterns and before the next lookup
+  void build();
+
+  T lookup(insn_bits_t bits) const
+  {
+    const slot_t& slot = slots[(bits & 0x7f) | ((bits >> 5) & 0x380)];
+    const entry_t* e = slot.sub ? slot.sub[(bits >> 25) & 0x7f] : slot.chain;
+    while ((bits & e->mask) != e->match)
+      e++;
+    return e->value;
+  }
+
+private:
+  static const uint32_t L1_MASK = 0x707f; // opcode and funct3
+  static const size_t L1_SIZE = 1024;
+  static const uint32_t L2_MASK = 0xfe000000; // funct7
+  static const size_t L2_SIZE = 128;
+
+  struct entry_t
+  {
+    uint32_t match;
+    uint32_t mask;
+    T value;
+  };
+
+  struct slot_t
+  {
+    const entry_t* chain;
+    const entry_t* const* sub;
+  };
+
+  T fallback;
+  std::vector<entry_t> patterns;
+  std::vector<entry_t> store; // all chains, back to back
+  std::vector<const entry_t*> subs; // all second-level tables
+  slot_t slots[L1_SIZE];
+};
+
+template <class T>
+void decode_table_t<T>::build()
+{
+  // identical chains are stored once, which keeps slots that ignore
+  // funct3 (or funct7) from multiplying the table size
+  std::map<std::vector<size_t>, size_t> interned;
+  store.clear();
+  auto intern = [&](const std::vector<size_t>& chain) {
+    auto it = interned.find(chain);
+    if (it != interned.end())
+      return it->second;
+    size_t offset = store.size();
+    for (size_t i : chain)
+      store.push_back(patterns[i]);
+    store.push_back((entry_t){0, 0, fallback});
+    interned[chain] = offset;
+    return offset;
+  };
+
+  std::vector<size_t> chain_offset(L1_SIZE);
+  std::vector<size_t> sub_offset(L1_SIZE, -1);
+  std::vector<size_t> sub_chain_offset;
+  for (size_t i = 0; i < L1_SIZE; i++)
+  {
+    uint32_t bits = (i & 0x7f) | ((i & 0x380) << 5);
+    std::vector<size_t> candidates;
+    bool split = false;
+    for (size_t p = 0; p < patterns.size(); p++)
+    {
+      if (((bits ^ patterns[p].match) & patterns[p].mask & L1_MASK) == 0)
+      {
+        candidates.push_back(p);
+        split |= (patterns[p].mask & L2_MASK) != 0;
+      }
+    }
+
+    if (!split)
+    {
+      chain_offset[i] = intern(candidates);
+      continue;
+    }
+
+    sub_offset[i] = sub_chain_offset.size();
+    for (size_t j = 0; j < L2_SIZE; j++)
+    {
+      std::vector<size_t> chain;
+      for (size_t p : candidates)
+        if ((((uint32_t)j << 25 ^ patterns[p].match) & patterns[p].mask & L2_MASK) == 0)
+          chain.push_back(p);
+      sub_chain_offset.push_back(intern(chain));
+    }
+  }
+
+  // store is complete, so offsets into it can become pointers
+  subs.resize(sub_chain_offset.size());
+  for (size_t k = 0; k < subs.size(); k++)
+    subs[k] = &store[sub_chain_offset[k]];
+  for (size_t i = 0; i < L1_SIZE; i++)
+  {
+    slots[i].chain = sub_offset[i] == size_t(-1) ? &store[chain_offset[i]] : NULL;
+    slots[i].sub = sub_offset[i] == size_t(-1) ? NULL : &subs[sub_offset[i]];
+  }
+}
+
+#endif
@@ -0,0 +1,106 @@
+// See LICENSE for license details.
+
+#include "decoder.h"
+#include "extension.h"
+#include "disasm.h"
+#include <algorithm>
+#include <assert.h>
+
+static const insn_desc_t illegal_desc = {
+  0, 0, &illegal_instruction, &illegal_instruction,
+  &illegal_instruction, &illegal_instruction
+};
+
+decoder_t::decoder_t(extension_t* x)
+  : table(&illegal_desc), disassembler(new disassembler_t)
+{
+  #define DECLARE_INSN(name, match, mask) REGISTER_INSN(this, name, match, mask)
+  #include "encoding.h"
+  #undef DECLARE_INSN
+
+  if (x)
+  {
+    for (auto insn : x->get_instructions())
+      register_insn(insn);
+    for (auto disasm_insn : x->get_disasms())
+      disassembler->add_insn(disasm_insn);
+  }
+
+  // keep the priority order of the old per-opcode chains: by opcode, then
+  // by match value
+  struct cmp {
+    bool operator()(const insn_desc_t& lhs, const insn_desc_t& rhs) {
+      if ((lhs.match & 0x7f) != (rhs.match & 0x7f))
+        return (lhs.match & 0x7f) < (rhs.match & 0x7f);
+      return lhs.match < rhs.match;
+    }
+  };
+  std::sort(instructions.begin(), instructions.end(), cmp());
+
+  for (auto& inst : instructions)
+    table.add(inst.match, inst.mask, &inst);
+  table.build();
+
+  // the disassembler builds its table on first use; have it do so now,
+  // while only this thread can see it
+  disassembler->disassemble(insn_t(0));
+}
+
+decoder_t::~decoder_t()
+{
+  delete disassembler;
+}
+
+void decoder_t::register_insn(insn_desc_t desc)
+{
+  assert(desc.mask & 1);
+  if (!desc.rv32_traced)
+    desc.rv32_traced = desc.rv32;
+  if (!desc.rv64_traced)
+    desc.rv64_traced = desc.rv64;
+  instructions.push_back(desc);
+}
+
+decode_cache_t::decode_cache_t()
+  : entries(new entry_t[ENTRIES]()), generation(1)
+{
+}
+
+bool decode_cache_t::lookup(reg_t paddr, const decoder_t* decoder,
+                            uint64_t gen, insn_bits_t* bits,
+                            const insn_desc_t** desc) const
+{
+  entry_t& e = entry(paddr);
+  uint32_t seq = e.seq.load(std::memory_order_acquire);
+  if (seq & 1)
+    return false;
+
+  bool hit = e.paddr.load(std::memory_order_relaxed) == paddr &&
+             e.generation.load(std::memory_order_relaxed) == gen &&
+             e.decoder.load(std::memory_order_relaxed) == decoder;
+  *bits = e.bits.load(std::memory_order_relaxed);
+  *desc = e.desc.load(std::memory_order_relaxed);
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return hit && e.seq.load(std::memory_order_relaxed) == seq;
+}
+
+void decode_cache_t::insert(reg_t paddr, const decoder_t* decoder,
+                            uint64_t gen, insn_bits_t bits,
+                            const insn_desc_t* desc)
+{
+  entry_t& e = entry(paddr);
+  uint32_t seq = e.seq.load(std::memory_order_relaxed);
+  if ((seq & 1) || !e.seq.compare_exchange_strong(seq, seq + 1,
+                                                  std::memory_order_acquire))
+    return;
+  std::atomic_thread_fence(std::memory_order_release);
+
+  e.paddr.store(paddr, std::memory_order_relaxed);
+  e.generation.store(gen, std::memory_order_relaxed);
+  e.decoder.store(decoder, std::memory_order_relaxed);
+  e.bits.store(bits, std::memory_order_relaxed);
+  e.desc.store(desc, std::memory_order_relaxed);
+
+  e.seq.store(seq + 2, std::memory_order_release);
+}
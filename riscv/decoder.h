@@ -0,0 +1,91 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_DECODER_H
+#define _RISCV_DECODER_H
+
+#include "decode.h"
+#include "decode_table.h"
+#include "processor.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class extension_t;
+class disassembler_t;
+
+// the handlers and disassembly of the base ISA's instructions and those of
+// at most one extension. it never changes once built, so a simulator
+// builds one per extension its processors use, and they all share it.
+class decoder_t
+{
+public:
+  decoder_t(extension_t* x);
+  ~decoder_t();
+
+  const insn_desc_t* decode(insn_bits_t bits) const { return table.lookup(bits); }
+  disassembler_t* get_disassembler() const { return disassembler; }
+
+private:
+  std::vector<insn_desc_t> instructions;
+  decode_table_t<const insn_desc_t*> table;
+  disassembler_t* disassembler;
+
+  void register_insn(insn_desc_t);
+};
+
+// instructions already decoded, by physical address, for all the harts of
+// a simulator, which then decode code they share just once.
+//
+// harts on host threads of their own fill it side by side. each entry has
+// a sequence count that is odd while it is being written, and readers
+// check it before and after, so they never take a torn entry; a writer
+// finding an entry busy leaves it be. flushing starts a new generation,
+// and entries of older ones never match again.
+class decode_cache_t
+{
+public:
+  decode_cache_t();
+
+  // a fence.i on any hart, or the host writing memory, flushes it
+  void flush() { generation.fetch_add(1, std::memory_order_acq_rel); }
+  // read before fetching the instruction that insert is then given
+  uint64_t get_generation() const
+  {
+    return generation.load(std::memory_order_acquire);
+  }
+
+  bool lookup(reg_t paddr, const decoder_t* decoder, uint64_t gen,
+              insn_bits_t* bits, const insn_desc_t** desc) const;
+  void insert(reg_t paddr, const decoder_t* decoder, uint64_t gen,
+              insn_bits_t bits, const insn_desc_t* desc);
+
+private:
+  static const size_t ENTRIES = 16384;
+
+  // fields are atomics only so that reading one while it is written is
+  // defined; the sequence count orders them
+  struct entry_t
+  {
+    std::atomic<uint32_t> seq;
+    std::atomic<reg_t> paddr;
+    std::atomic<uint64_t> generation;
+    std::atomic<const decoder_t*> decoder;
+    std::atomic<insn_bits_t> bits;
+    std::atomic<const insn_desc_t*> desc;
+  };
+
+  std::unique_ptr<entry_t[]> entries;
+  std::atomic<uint64_t> generation; // 0 is that of entries never written
+
+  entry_t& entry(reg_t paddr) const { return entries[(paddr / 4) % ENTRIES]; }
+};
+
+#define REGISTER_INSN(decoder, name, match, mask) \
+  extern reg_t rv32_##name(processor_t*, insn_t, reg_t); \
+  extern reg_t rv64_##name(processor_t*, insn_t, reg_t); \
+  extern reg_t rv32_##name##_traced(processor_t*, insn_t, reg_t); \
+  extern reg_t rv64_##name##_traced(processor_t*, insn_t, reg_t); \
+  decoder->register_insn((insn_desc_t){match, mask, rv32_##name, rv64_##name, \
+                                       rv32_##name##_traced, rv64_##name##_traced});
+
+#endif
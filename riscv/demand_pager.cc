@@ -0,0 +1,295 @@
+// See LICENSE for license details.
+
+#include "demand_pager.h"
+#include <algorithm>
+#include <mutex>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/userfaultfd.h>
+#endif
+
+// the pagers the SIGSEGV handler looks through
+static const int MAX_SEGV_PAGERS = 16;
+static std::atomic<demand_pager_t*> segv_pagers[MAX_SEGV_PAGERS];
+static struct sigaction old_segv_action;
+static std::mutex segv_lock;
+static bool segv_installed = false;
+static const size_t MAX_SEGV_UNITS = 16384;
+
+demand_pager_t::demand_pager_t(char* base, size_t size, size_t page_size,
+                               std::vector<source_t> sources)
+  : base(base), size(size), pgsize(page_size),
+    unit(std::max<size_t>(page_size, sysconf(_SC_PAGESIZE))),
+    sources(std::move(sources)),
+    uffd(-1), segv_slot(-1), proc_mem_fd(-1)
+{
+  wake_pipe[0] = wake_pipe[1] = -1;
+  if (!start_userfaultfd())
+    start_sigsegv();
+}
+
+void demand_pager_t::reset_state()
+{
+  state.reset(new std::atomic<unsigned char>[size / unit]);
+  for (size_t u = 0; u < size / unit; u++)
+    state[u] = MISSING;
+}
+
+demand_pager_t::~demand_pager_t()
+{
+  stop();
+}
+
+// called from the fault thread and from signal handlers, so it sticks to
+// async-signal-safe calls
+void demand_pager_t::read_unit(size_t u, char* buf)
+{
+  for (size_t off = 0; off < unit; off += pgsize)
+  {
+    const source_t& src = sources[(u * unit + off) / pgsize];
+    if (src.file.empty())
+    {
+      memset(buf + off, 0, pgsize);
+      continue;
+    }
+
+    int fd = open(src.file.c_str(), O_RDONLY | O_CLOEXEC);
+    bool ok = fd >= 0 && pread(fd, buf + off, pgsize, src.offset) == ssize_t(pgsize);
+    if (fd >= 0)
+      close(fd);
+    if (!ok)
+    {
+      static const char msg[] = "Cannot read a checkpointed page from ";
+      write(2, msg, sizeof(msg) - 1);
+      write(2, src.file.c_str(), src.file.size());
+      write(2, "\n", 1);
+      abort();
+    }
+  }
+}
+
+bool demand_pager_t::start_userfaultfd()
+{
+#if defined(__linux__) && defined(__NR_userfaultfd)
+  if ((uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK)) < 0)
+    return false;
+  reset_state();
+
+  struct uffdio_api api = uffdio_api();
+  api.api = UFFD_API;
+  struct uffdio_register reg = uffdio_register();
+  reg.range.start = (uintptr_t)base;
+  reg.range.len = size;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (ioctl(uffd, UFFDIO_API, &api) != 0 ||
+      ioctl(uffd, UFFDIO_REGISTER, &reg) != 0 ||
+      pipe(wake_pipe) != 0)
+  {
+    close(uffd);
+    uffd = -1;
+    return false;
+  }
+
+  fault_thread = std::thread(&demand_pager_t::serve_faults, this);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void demand_pager_t::serve_faults()
+{
+#if defined(__linux__) && defined(__NR_userfaultfd)
+  char* buf = (char*)mmap(NULL, unit, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  while (true)
+  {
+    struct pollfd fds[2] = {{uffd, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents)
+      break;
+
+    // the fd is nonblocking, since a fault poll() saw can be gone by now
+    struct uffd_msg msg;
+    if (read(uffd, &msg, sizeof(msg)) != sizeof(msg) ||
+        msg.event != UFFD_EVENT_PAGEFAULT)
+      continue;
+
+    size_t u = ((char*)(uintptr_t)msg.arg.pagefault.address - base) / unit;
+    uintptr_t dst = (uintptr_t)(base + u * unit);
+    bool zero = true;
+    for (size_t off = 0; off < unit; off += pgsize)
+      zero &= sources[(u * unit + off) / pgsize].file.empty();
+
+    int ret;
+    if (zero)
+    {
+      struct uffdio_zeropage z = {{dst, unit}, 0, 0};
+      ret = ioctl(uffd, UFFDIO_ZEROPAGE, &z);
+    }
+    else
+    {
+      read_unit(u, buf);
+      struct uffdio_copy c = {dst, (uintptr_t)buf, unit, 0, 0};
+      ret = ioctl(uffd, UFFDIO_COPY, &c);
+    }
+
+    // a second fault on a unit that is already in only needs a wakeup
+    if (ret != 0 && errno == EEXIST)
+    {
+      struct uffdio_range r = {dst, unit};
+      ioctl(uffd, UFFDIO_WAKE, &r);
+    }
+    state[u] = FILLED;
+  }
+  munmap(buf, unit);
+#endif
+}
+
+void demand_pager_t::start_sigsegv()
+{
+  // each filled unit is a mapping of its own once unprotected, so keep
+  // their number well under the kernel's limit on mappings
+  while (size / unit > MAX_SEGV_UNITS && size % (unit * 2) == 0)
+    unit *= 2;
+  reset_state();
+
+  {
+    std::lock_guard<std::mutex> guard(segv_lock);
+    for (int i = 0; i < MAX_SEGV_PAGERS && segv_slot < 0; i++)
+      if (!segv_pagers[i])
+        segv_slot = i;
+    if (segv_slot >= 0 && !segv_installed)
+    {
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = segv_handler;
+      sa.sa_flags = SA_SIGINFO;
+      sigemptyset(&sa.sa_mask);
+      segv_installed = sigaction(SIGSEGV, &sa, &old_segv_action) == 0;
+    }
+  }
+
+  // with no handler, just read everything in now
+  if (segv_slot < 0 || !segv_installed)
+  {
+    for (size_t u = 0; u < size / unit; u++)
+    {
+      read_unit(u, base + u * unit);
+      state[u] = FILLED;
+    }
+    segv_slot = -1;
+    return;
+  }
+
+  // writing through /proc/self/mem works on protected pages, so a page can
+  // be complete before any other thread can see it
+  proc_mem_fd = open("/proc/self/mem", O_RDWR | O_CLOEXEC);
+  segv_pagers[segv_slot] = this;
+  mprotect(base, size, PROT_NONE);
+}
+
+void demand_pager_t::segv_fault(char* addr)
+{
+  size_t u = (addr - base) / unit;
+  char* dst = base + u * unit;
+  unsigned char expected = MISSING;
+  if (state[u].compare_exchange_strong(expected, FILLING))
+  {
+    // a unit can be too big for the faulting thread's stack
+    bool written = false;
+    if (proc_mem_fd >= 0)
+    {
+      void* buf = mmap(NULL, unit, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (buf != MAP_FAILED)
+      {
+        read_unit(u, (char*)buf);
+        written = pwrite(proc_mem_fd, buf, unit, (off_t)(uintptr_t)dst) == ssize_t(unit);
+        munmap(buf, unit);
+      }
+    }
+    mprotect(dst, unit, PROT_READ | PROT_WRITE);
+    if (!written)
+      read_unit(u, dst);
+    state[u] = FILLED;
+    return;
+  }
+
+  // some other thread is filling it, or filled it after this thread took
+  // its fault; either way the access only needs to run again
+  while (state[u] != FILLED)
+    sched_yield();
+}
+
+void demand_pager_t::segv_handler(int sig, siginfo_t* info, void* ctx)
+{
+  char* addr = (char*)info->si_addr;
+  for (int i = 0; i < MAX_SEGV_PAGERS; i++)
+  {
+    demand_pager_t* pager = segv_pagers[i];
+    if (pager && pager->contains(addr))
+    {
+      pager->segv_fault(addr);
+      return;
+    }
+  }
+
+  // not one of ours: hand it on, or let it take its default course when
+  // the instruction runs again
+  if (old_segv_action.sa_flags & SA_SIGINFO)
+    old_segv_action.sa_sigaction(sig, info, ctx);
+  else if (old_segv_action.sa_handler != SIG_DFL &&
+           old_segv_action.sa_handler != SIG_IGN)
+    old_segv_action.sa_handler(sig);
+  else
+    signal(SIGSEGV, SIG_DFL);
+}
+
+void demand_pager_t::fill_all()
+{
+  for (size_t u = 0; u < size / unit; u++)
+    if (state[u] != FILLED)
+      (void)*(volatile char*)(base + u * unit);
+  stop();
+}
+
+void demand_pager_t::stop()
+{
+  if (uffd >= 0)
+  {
+    write(wake_pipe[1], "", 1);
+    fault_thread.join();
+    close(uffd);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    uffd = -1;
+  }
+
+  if (segv_slot >= 0)
+  {
+    segv_pagers[segv_slot] = NULL;
+    segv_slot = -1;
+  }
+
+  if (proc_mem_fd >= 0)
+  {
+    close(proc_mem_fd);
+    proc_mem_fd = -1;
+  }
+}
@@ -0,0 +1,65 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_DEMAND_PAGER_H
+#define _RISCV_DEMAND_PAGER_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// fills a range of memory from files, a page at a time, when each page is
+// first touched. the range must hold nothing yet. faults are taken through
+// userfaultfd where the host allows it, and are resolved on a thread of
+// their own; otherwise the range is protected and a SIGSEGV handler fills
+// pages on the faulting thread.
+class demand_pager_t
+{
+public:
+  // where a page comes from: len bytes of file from offset on, or zeros
+  // if file is empty
+  struct source_t
+  {
+    std::string file;
+    off_t offset;
+  };
+
+  // sources has one entry per page of page_size bytes in the range
+  demand_pager_t(char* base, size_t size, size_t page_size,
+                 std::vector<source_t> sources);
+  ~demand_pager_t();
+
+  // fill every page that has not been touched yet, and stop taking faults
+  void fill_all();
+
+private:
+  char* base;
+  size_t size;
+  size_t pgsize;
+  size_t unit; // what one fault fills: at least a page and a host page
+  std::vector<source_t> sources;
+  std::unique_ptr<std::atomic<unsigned char>[]> state; // per unit
+  enum { MISSING, FILLING, FILLED };
+
+  int uffd; // or -1 when faults come in as SIGSEGV
+  int wake_pipe[2]; // ends the fault thread
+  std::thread fault_thread;
+  int segv_slot; // where the SIGSEGV handler finds this pager, or -1
+  int proc_mem_fd; // lets SIGSEGV mode write pages before unprotecting them
+
+  bool start_userfaultfd();
+  void start_sigsegv();
+  void stop();
+  void reset_state();
+  void serve_faults();
+  void read_unit(size_t u, char* buf);
+  bool contains(const char* addr) { return addr >= base && addr < base + size; }
+  void segv_fault(char* addr);
+  static void segv_handler(int sig, siginfo_t* info, void* ctx);
+};
+
+#endif
@@ -127,6 +127,7 @@ std::string disassembler_t::disassemble(insn_t insn)
 }
 
 disassembler_t::disassembler_t()
+  : table(NULL), table_stale(true)
 {
   const uint32_t mask_rd = 0x1fUL << 7;
   const uint32_t match_rd_ra = 1UL << 7;
@@ -375,30 +376,32 @@ disassembler_t::disassembler_t()
 
 const disasm_insn_t* disassembler_t::lookup(insn_t insn)
 {
-  size_t idx = insn.bits() % HASH_SIZE;
-  for (size_t j = 0; j < chain[idx].size(); j++)
-    if(*chain[idx][j] == insn)
-      return chain[idx][j];
-
-  idx = HASH_SIZE;
-  for (size_t j = 0; j < chain[idx].size(); j++)
-    if(*chain[idx][j] == insn)
-      return chain[idx][j];
+  if (table_stale)
+  {
+    // entries that pin down the whole low byte (in practice, aliases that
+    // fix rd) are preferred, then everything else in the order added
+    table.clear();
+    for (auto i : insns)
+      if (i->get_mask() % 256 == 255)
+        table.add(i->get_match(), i->get_mask(), i);
+    for (auto i : insns)
+      if (i->get_mask() % 256 != 255)
+        table.add(i->get_match(), i->get_mask(), i);
+    table.build();
+    table_stale = false;
+  }
 
-  return NULL;
+  return table.lookup(insn.bits());
 }
 
 void disassembler_t::add_insn(disasm_insn_t* insn)
 {
-  size_t idx = HASH_SIZE;
-  if (insn->get_mask() % HASH_SIZE == HASH_SIZE - 1)
-    idx = insn->get_match() % HASH_SIZE;
-  chain[idx].push_back(insn);
+  insns.push_back(insn);
+  table_stale = true;
 }
 
 disassembler_t::~disassembler_t()
 {
-  for (size_t i = 0; i < HASH_SIZE+1; i++)
-    for (size_t j = 0; j < chain[i].size(); j++)
-      delete chain[i][j];
+  for (size_t i = 0; i < insns.size(); i++)
+    delete insns[i];
 }
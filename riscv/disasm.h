@@ -4,6 +4,7 @@
 #define _RISCV_DISASM_H
 
 #include "decode.h"
+#include "decode_table.h"
 #include <string>
 #include <sstream>
 #include <vector>
@@ -65,8 +66,9 @@ class disassembler_t
   std::string disassemble(insn_t insn);
   void add_insn(disasm_insn_t* insn);
  private:
-  static const int HASH_SIZE = 256;
-  std::vector<const disasm_insn_t*> chain[HASH_SIZE+1];
+  std::vector<const disasm_insn_t*> insns;
+  decode_table_t<const disasm_insn_t*> table;
+  bool table_stale;
   const disasm_insn_t* lookup(insn_t insn);
 };
 
@@ -0,0 +1,177 @@
+// See LICENSE for license details.
+
+#include "fork_server.h"
+#include "sim.h"
+#include "htif.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+fork_server_t::fork_server_t(sim_t* sim, const std::vector<std::string>& args,
+                             size_t insns)
+  : sim(sim), args(args), insns(insns)
+{
+}
+
+static void reply(int fd, const std::string& msg)
+{
+  std::string line = msg + "\n";
+  for (size_t done = 0; done < line.size(); )
+  {
+    ssize_t n = write(fd, line.data() + done, line.size() - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    done += n;
+  }
+}
+
+bool fork_server_t::serve(const std::string& path, size_t max_jobs)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path '%s' is too long\n", path.c_str());
+    return false;
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path.c_str());
+  if (sock < 0 || bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(sock, 64) != 0) {
+    perror(path.c_str());
+    if (sock >= 0)
+      close(sock);
+    return false;
+  }
+
+  // a client that goes away must not take the server with it
+  signal(SIGPIPE, SIG_IGN);
+  max_jobs = std::max(max_jobs, size_t(1));
+  fprintf(stderr, "Serving jobs on %s\n", path.c_str());
+
+  // polled rather than waited for, so that ^C is seen; the jobs running
+  // then are still seen through
+  while (!ctrlc_pressed || !jobs.empty())
+  {
+    reap_jobs();
+    bool accepting = !ctrlc_pressed && jobs.size() < max_jobs;
+    pollfd pfd = {sock, POLLIN, 0};
+    if (poll(&pfd, accepting ? 1 : 0, 100) <= 0 || !accepting)
+      continue;
+
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0)
+      continue;
+
+    fflush(NULL);
+    std::cout.flush();
+    std::cerr.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(sock);
+      for (size_t i = 0; i < jobs.size(); i++)
+        close(jobs[i].fd);
+      run_job(fd);
+    }
+    if (pid < 0) {
+      perror("fork");
+      reply(fd, "error: cannot fork");
+      close(fd);
+      continue;
+    }
+    jobs.push_back(job_t{pid, fd});
+  }
+
+  close(sock);
+  unlink(path.c_str());
+  return true;
+}
+
+// a job that ends normally says so itself, so only the others are told
+// about here
+void fork_server_t::reap_jobs()
+{
+  for (size_t i = 0; i < jobs.size(); )
+  {
+    int status = 0;
+    pid_t ret = waitpid(jobs[i].pid, &status, WNOHANG);
+    if (ret == 0 || (ret < 0 && errno == EINTR)) {
+      i++;
+      continue;
+    }
+
+    if (ret > 0 && WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM)
+      reply(jobs[i].fd, "timeout");
+    else if (ret > 0 && WIFSIGNALED(status))
+      reply(jobs[i].fd, "killed by signal " + std::to_string(WTERMSIG(status)));
+    else if (ret < 0 || WEXITSTATUS(status) != 0)
+      reply(jobs[i].fd, "failed");
+    close(jobs[i].fd);
+    jobs.erase(jobs.begin() + i);
+  }
+}
+
+// runs in the child, with the job's connection as its stdout and stderr,
+// and never returns
+void fork_server_t::run_job(int fd)
+{
+  signal(SIGINT, SIG_DFL);
+
+  std::string line;
+  char c;
+  while (read(fd, &c, 1) == 1 && c != '\n')
+    line += c;
+  dup2(fd, 1);
+  dup2(fd, 2);
+
+  std::istringstream in(line);
+  std::vector<std::string> job_args(args);
+  size_t limit = insns, timeout = 0;
+  std::string word;
+  while (in >> word)
+  {
+    if (word == "-e" && in >> limit)
+      continue;
+    if (word == "-t" && in >> timeout)
+      continue;
+    if (word[0] == '-') {
+      reply(fd, "error: bad option " + word);
+      _exit(0);
+    }
+    job_args.push_back(word);
+    while (in >> word)
+      job_args.push_back(word);
+  }
+  if (job_args.empty()) {
+    reply(fd, "error: no program");
+    _exit(0);
+  }
+
+  alarm(timeout);
+  sim->reconnect_host(job_args);
+  sim->boot();
+  bool running = limit ? sim->run(limit) : (sim->run(), false);
+
+  fflush(NULL);
+  std::cout.flush();
+  std::cerr.flush();
+  if (running)
+    reply(fd, "stopped after " + std::to_string(limit) + " instructions");
+  else
+    reply(fd, "exit " + std::to_string(sim->get_htif()->exit_code()));
+  _exit(0);
+}
@@ -0,0 +1,48 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_FORK_SERVER_H
+#define _RISCV_FORK_SERVER_H
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+class sim_t;
+
+// runs jobs sent to a Unix socket, each in a forked copy of one simulator
+// that is set up once and never booted. a job is one line: options, then
+// the arguments for the host, which go after those the server was given.
+//
+//   -e <n>   stop after <n> instructions
+//   -t <s>   give up after <s> seconds
+//
+// the job's output comes back over its connection, and its last line
+// says how it ended: "exit <code>", "stopped after <n> instructions",
+// "timeout", or why it failed.
+class fork_server_t
+{
+public:
+  fork_server_t(sim_t* sim, const std::vector<std::string>& args,
+                size_t insns);
+
+  // serve until interrupted, with up to jobs of them running at once, and
+  // report whether the socket could be set up
+  bool serve(const std::string& path, size_t jobs);
+
+private:
+  struct job_t
+  {
+    pid_t pid;
+    int fd; // the connection it came in on
+  };
+
+  sim_t* sim;
+  std::vector<std::string> args;
+  size_t insns; // a job's default limit, or 0 for none
+  std::vector<job_t> jobs;
+
+  void run_job(int fd);
+  void reap_jobs();
+};
+
+#endif
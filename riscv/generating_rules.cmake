@@ -34,6 +34,15 @@ add_custom_command(
         COMMAND bash -c "${CMAKE_CURRENT_SOURCE_DIR}/gen_icache `grep 'ICACHE_ENTRIES =' ${CMAKE_CURRENT_SOURCE_DIR}/mmu.h | sed 's/.* = \\(.*\\);/\\1/'` > ${riscv_gen_icache_h}"
 )
 
+# Generate threaded.h using script gen_threaded
+set(riscv_gen_threaded_h ${CMAKE_CURRENT_BINARY_DIR}/threaded.h)
+add_custom_command(
+        DEPENDS ${CMAKE_CURRENT_SOURCE_DIR}/gen_threaded ${CMAKE_CURRENT_SOURCE_DIR}/encoding.h
+        OUTPUT ${riscv_gen_threaded_h}
+        VERBATIM
+        COMMAND bash -c "${CMAKE_CURRENT_SOURCE_DIR}/gen_threaded ${CMAKE_CURRENT_SOURCE_DIR}/encoding.h > ${riscv_gen_threaded_h}"
+)
+
 # Passing the manifest of generated sources with lists riscv_gen_srcs & riscv_gen_hdrs
 set(
         riscv_gen_srcs
@@ -43,4 +52,5 @@ set(
 set(
         riscv_gen_hdrs
         ${riscv_gen_icache_h}
+        ${riscv_gen_threaded_h}
 )
@@ -2,6 +2,7 @@
 
 #include "htif.h"
 #include "sim.h"
+#include "decoder.h"
 #include "encoding.h"
 #include <unistd.h>
 #include <stdexcept>
@@ -17,17 +18,27 @@
 
 extern bool logging_on;
 
+// a binary HTIF log is the signature, the number of words that follow, and
+// then its records. each starts with a word holding the kind of record in
+// its low byte and a count or core number above that:
+//   LOG_TICK      count ticks
+//   LOG_MEM       count words to store from the word address that follows
+//   LOG_TOHOST    the value the core's tohost takes
+//   LOG_FROMHOST  the value the core's fromhost takes
+// replay ticks once more at the end, as it does for END_HTIF_CHECKPOINT.
+// the first byte of the signature is never the first byte of a text log.
+static const uint64_t HTIF_LOG_SIGNATURE = 0xbaadbeef4a710901;
+enum { LOG_TICK, LOG_MEM, LOG_TOHOST, LOG_FROMHOST };
+
 htif_isasim_t::htif_isasim_t(sim_t* _sim, const std::vector<std::string>& args)
-  : htif_pthread_t(args), sim(_sim), reset(true), seqno(1), checkpoint(NULL)
+  : htif_pthread_t(args), sim(_sim), reset(true), seqno(1), last_tick(SIZE_MAX),
+    host_record(NULL), host_replay_pos(0), host_replaying(false)
 {
     checkpointing_active = false;
 }
 
 htif_isasim_t::~htif_isasim_t()
 {
-  if (this->checkpoint) {
-    free(this->checkpoint);
-  }
 }
 
 // This is called by sim as a way to transfer control to HTIF host module so that any pending
@@ -58,11 +69,11 @@ bool htif_isasim_t::tick()
 void htif_isasim_t::tick_once()
 {
   packet_header_t hdr;
-  recv(&hdr, sizeof(hdr));
+  host_recv(&hdr, sizeof(hdr));
 
   char buf[hdr.get_packet_size()];
   memcpy(buf, &hdr, sizeof(hdr));
-  recv(buf + sizeof(hdr), hdr.get_payload_size());
+  host_recv(buf + sizeof(hdr), hdr.get_payload_size());
   packet_t p(buf);
 
   assert(hdr.seqno == seqno);
@@ -82,21 +93,18 @@ void htif_isasim_t::tick_once()
       ifprintf(logging_on,stderr,"HTIF_CMD_READ_MEM seq no: %" PRIu8 "\n", seqno);
 
       packet_header_t ack(HTIF_CMD_ACK, seqno, hdr.data_size, 0);
-      send(&ack, sizeof(ack));
+      host_send(&ack, sizeof(ack));
 
       uint64_t buf[hdr.data_size];
       for (size_t i = 0; i < hdr.data_size; i++)
         buf[i] = sim->debug_mmu->load_uint64((hdr.addr+i)*HTIF_DATA_ALIGN);
 
       if(checkpointing_active){
-        *checkpoint << "READ_MEM" << " " << hdr.addr << " " << hdr.data_size << std::endl;
-        for (size_t i = 0; i < hdr.data_size; i++){
-          *checkpoint << buf[i] << " ";
-        }
-        *checkpoint << std::endl;
+        log_setup(hdr.addr, buf, hdr.data_size);
+        log_tick();
       }
 
-      send(buf, hdr.data_size * sizeof(buf[0]));
+      host_send(buf, hdr.data_size * sizeof(buf[0]));
       break;
     }
     case HTIF_CMD_WRITE_MEM:
@@ -106,17 +114,17 @@ void htif_isasim_t::tick_once()
       const uint64_t* buf = (const uint64_t*)p.get_payload();
       for (size_t i = 0; i < hdr.data_size; i++)
         sim->debug_mmu->store_uint64((hdr.addr+i)*HTIF_DATA_ALIGN, buf[i]);
+      // it may have loaded code over some the harts have run
+      if (sim->decode_cache)
+        sim->decode_cache->flush();
 
       if(checkpointing_active){
-        *checkpoint << "WRITE_MEM" << " " << hdr.addr << " " << hdr.data_size << std::endl;
-        for (size_t i = 0; i < hdr.data_size; i++){
-          *checkpoint << buf[i] << " ";
-        }
-        *checkpoint << std::endl;
+        log_write(hdr.addr, buf, hdr.data_size);
+        log_tick();
       }
 
       packet_header_t ack(HTIF_CMD_ACK, seqno, 0, 0);
-      send(&ack, sizeof(ack));
+      host_send(&ack, sizeof(ack));
       break;
     }
     case HTIF_CMD_READ_CONTROL_REG:
@@ -131,15 +139,15 @@ void htif_isasim_t::tick_once()
       ifprintf(logging_on,stderr,"HTIF_CMD_READ/WRITE_CONTROL_REG reg no: %" PRIreg " seq no: %" PRIu8 "\n",regno, seqno);
 
       packet_header_t ack(HTIF_CMD_ACK, seqno, 1, 0);
-      send(&ack, sizeof(ack));
+      host_send(&ack, sizeof(ack));
 
       if (coreid == 0xFFFFF) // system control register space
       {
         uint64_t scr = sim->get_scr(regno);
         if(checkpointing_active){
-          *checkpoint << "MOD_SCR " << coreid << " " << regno << " " << scr << " " << scr << std::endl;
+          log_tick();
         }
-        send(&scr, sizeof(scr));
+        host_send(&scr, sizeof(scr));
         break;
       }
 
@@ -184,10 +192,14 @@ void htif_isasim_t::tick_once()
       // Print TOHOST content only when something significant happens)
       if((regno != (CSR_TOHOST & 0x1f)) || ((old_val != 0) || (old_val != new_val))){
         if(checkpointing_active){
-          *checkpoint << "MOD_SCR " << coreid << " " << regno << " " << old_val << " " << new_val << std::endl;
+          if (regno == (CSR_TOHOST & 0x1f))
+            log_reg(LOG_TOHOST, coreid, old_val);
+          else if (regno == (CSR_FROMHOST & 0x1f))
+            log_reg(LOG_FROMHOST, coreid, old_val);
+          log_tick();
         }
       }
-      send(&old_val, sizeof(old_val));
+      host_send(&old_val, sizeof(old_val));
       break;
     }
     default:
@@ -196,6 +208,39 @@ void htif_isasim_t::tick_once()
   seqno++;
 }
 
+void htif_isasim_t::replay_host(const std::string& data)
+{
+  host_replay = data;
+  host_replay_pos = 0;
+  host_replaying = true;
+}
+
+void htif_isasim_t::host_recv(void* buf, size_t len)
+{
+  if (!host_replaying)
+  {
+    recv(buf, len);
+    if (host_record)
+      host_record->append((const char*)buf, len);
+    return;
+  }
+
+  // only a target that strays from the run recorded gets here
+  if (len > host_replay.size() - host_replay_pos)
+  {
+    fprintf(stderr, "Ran out of recorded host packets\n");
+    abort();
+  }
+  memcpy(buf, host_replay.data() + host_replay_pos, len);
+  host_replay_pos += len;
+}
+
+void htif_isasim_t::host_send(const void* buf, size_t len)
+{
+  if (!host_replaying)
+    send(buf, len);
+}
+
 bool htif_isasim_t::done()
 {
   if (reset)
@@ -248,8 +293,76 @@ bool htif_isasim_t::restore_checkpoint(std::istream& restore)
   // If reset is low (normal operation) tick only once to complete a single pending transaction
   //do tick_once(); while (reset);
 
-  FILE* restore_log = fopen("restore.htif","w");
+  if (restore.peek() == int(HTIF_LOG_SIGNATURE & 0xff))
+    return restore_binary_checkpoint(restore);
+  return restore_text_checkpoint(restore);
+}
+
+// stores a setup record asks for go straight into memory, a run at a time
+void htif_isasim_t::replay_store(reg_t addr, const uint64_t* data, size_t n)
+{
+  reg_t paddr = addr * HTIF_DATA_ALIGN;
+  size_t len = n * sizeof(uint64_t);
+  if (HTIF_DATA_ALIGN == sizeof(uint64_t) &&
+      paddr <= sim->memsz && len <= sim->memsz - paddr)
+  {
+    memcpy(sim->mem + paddr, data, len);
+    size_t pgsize = sim->target_mem->page_size();
+    for (reg_t page = paddr - paddr % pgsize; page < paddr + len; page += pgsize)
+      sim->target_mem->mark_written(page);
+    return;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    sim->debug_mmu->store_uint64((addr+i)*HTIF_DATA_ALIGN, data[i]);
+}
+
+bool htif_isasim_t::restore_binary_checkpoint(std::istream& restore)
+{
+  uint64_t header[2];
+  restore.read((char*)header, sizeof(header));
+  std::vector<uint64_t> log(restore.good() && header[0] == HTIF_LOG_SIGNATURE ? header[1] : 0);
+  restore.read((char*)log.data(), log.size() * sizeof(uint64_t));
+  if (!restore.good() || header[0] != HTIF_LOG_SIGNATURE)
+  {
+    fprintf(stderr, "Cannot read the HTIF log of the checkpoint\n");
+    exit(-1);
+  }
+
+  size_t i = 0;
+  while (i < log.size())
+  {
+    uint64_t kind = log[i] & 0xff, count = log[i] >> 8;
+    size_t len = kind == LOG_TICK ? 0 : kind == LOG_MEM ? count + 1 : 1;
+    if (kind > LOG_FROMHOST || len >= log.size() - i ||
+        (kind >= LOG_TOHOST && count >= sim->procs.size()))
+      break;
 
+    const uint64_t* args = &log[i + 1];
+    if (kind == LOG_TICK)
+      for (uint64_t j = 0; j < count; j++)
+        tick_once();
+    else if (kind == LOG_MEM)
+      replay_store(args[0], &args[1], count);
+    else if (kind == LOG_TOHOST)
+      sim->get_core(count)->get_state()->tohost = args[0];
+    else
+      sim->get_core(count)->set_fromhost(args[0]);
+    i += 1 + len;
+  }
+  if (i != log.size())
+  {
+    fprintf(stderr, "Bad record at word %lu of the HTIF log\n", (unsigned long)i);
+    exit(-1);
+  }
+
+  tick_once();
+  return true;
+}
+
+// checkpoints from before the binary log hold it as text
+bool htif_isasim_t::restore_text_checkpoint(std::istream& restore)
+{
   std::string token1;
   reg_t token2, token3;
   replay_pkt_t pkt;
@@ -257,11 +370,11 @@ bool htif_isasim_t::restore_checkpoint(std::istream& restore)
   while(restore.good())
   {
     restore >> token1 >> token2 >> token3;
-    fprintf(restore_log,"Reading line: %s %ld %ld\n",token1.c_str(),token2,token3);
+    ifprintf(logging_on,stderr,"Reading line: %s %ld %ld\n",token1.c_str(),token2,token3);
     if(!token1.compare("READ_MEM"))
     {
 
-      fprintf(restore_log,"In READ_MEM\n");
+      ifprintf(logging_on,stderr,"In READ_MEM\n");
       // Create the data packet
       pkt.command = READ_MEM;
       pkt.addr = token2;
@@ -271,7 +384,7 @@ bool htif_isasim_t::restore_checkpoint(std::istream& restore)
     } 
     else if(!token1.compare("MOD_SCR"))
     {
-      fprintf(restore_log,"In MOD_SCR\n");
+      ifprintf(logging_on,stderr,"In MOD_SCR\n");
       // Update packet with SCR values
       pkt.command = MOD_SCR;
       pkt.coreid = token2;
@@ -304,8 +417,6 @@ bool htif_isasim_t::restore_checkpoint(std::istream& restore)
     tick_once();
   }
 
-  fclose(restore_log);
-
   return true;
 
 }
@@ -313,29 +424,100 @@ bool htif_isasim_t::restore_checkpoint(std::istream& restore)
 void htif_isasim_t::start_checkpointing()
 {
   checkpointing_active = true;
-  this->checkpoint = new std::stringstream();
+  checkpoint.clear();
+  last_tick = SIZE_MAX;
+  log_shadow.clear();
+}
+
+void htif_isasim_t::log_tick()
+{
+  if (last_tick != SIZE_MAX) {
+    checkpoint[last_tick] += uint64_t(1) << 8;
+    return;
+  }
+  last_tick = checkpoint.size();
+  checkpoint.push_back(LOG_TICK | uint64_t(1) << 8);
+}
+
+// the host is about to read these words, so replay has to put them there
+// first, except where they already hold what it will read
+void htif_isasim_t::log_setup(reg_t addr, const uint64_t* data, size_t n)
+{
+  size_t i = 0;
+  while (i < n)
+  {
+    auto it = log_shadow.find(addr + i);
+    if (it != log_shadow.end() && it->second == data[i]) {
+      i++;
+      continue;
+    }
+
+    size_t start = i;
+    for (; i < n; i++)
+    {
+      it = log_shadow.find(addr + i);
+      if (it != log_shadow.end() && it->second == data[i])
+        break;
+      log_shadow[addr + i] = data[i];
+    }
+    checkpoint.push_back(LOG_MEM | uint64_t(i - start) << 8);
+    checkpoint.push_back(addr + start);
+    checkpoint.insert(checkpoint.end(), data + start, data + i);
+    last_tick = SIZE_MAX;
+  }
+}
+
+// the host writes these itself when the log is replayed
+void htif_isasim_t::log_write(reg_t addr, const uint64_t* data, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    log_shadow[addr + i] = data[i];
+}
+
+void htif_isasim_t::log_reg(uint64_t op, reg_t coreid, uint64_t val)
+{
+  checkpoint.push_back(op | uint64_t(coreid) << 8);
+  checkpoint.push_back(val);
+  last_tick = SIZE_MAX;
 }
 
 void htif_isasim_t::output_checkpointing(std::ostream& checkpoint_file)
 {
   if(checkpointing_active){
-	  this->checkpoint->seekg(0);
-	  std::copy(
-	  	    std::istreambuf_iterator<char>(*this->checkpoint),
-	  	    std::istreambuf_iterator<char>(),
-	  	    std::ostreambuf_iterator<char>(checkpoint_file)
-	  );
-	  checkpoint_file << "END_HTIF_CHECKPOINT 0 0 0" << std::endl;
+    uint64_t header[2] = {HTIF_LOG_SIGNATURE, checkpoint.size()};
+    checkpoint_file.write((char*)header, sizeof(header));
+    checkpoint_file.write((char*)checkpoint.data(), checkpoint.size() * sizeof(uint64_t));
   }
 
 }
 
 void htif_isasim_t::stop_checkpointing()
 {
-  if(checkpointing_active){
-   *checkpoint << "END_HTIF_CHECKPOINT 0 0 0" << std::endl;
+  checkpointing_active = false;
+}
+
+bool htif_isasim_t::read_checkpoint(std::istream& in, std::string& htif_log)
+{
+  if (in.peek() == int(HTIF_LOG_SIGNATURE & 0xff))
+  {
+    uint64_t header[2];
+    in.read((char*)header, sizeof(header));
+    if (!in.good() || header[0] != HTIF_LOG_SIGNATURE)
+      return false;
+    htif_log.assign((char*)header, sizeof(header));
+    std::string words(header[1] * sizeof(uint64_t), 0);
+    in.read(&words[0], words.size());
+    htif_log += words;
+    return in.good();
   }
 
-  checkpointing_active = false;
+  // a text log runs through the END_HTIF_CHECKPOINT line
+  std::string line;
+  while (std::getline(in, line)) {
+    htif_log += line + "\n";
+    if (line.compare(0, 19, "END_HTIF_CHECKPOINT") == 0)
+      return true;
+  }
+  return false;
 }
 
@@ -6,6 +6,8 @@
 #include <fesvr/htif_pthread.h>
 #include <fstream>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
 //#include <gzstream.h>
 
 class sim_t;
@@ -51,6 +53,16 @@ public:
   void output_checkpointing(std::ostream& checkpoint_file);
   void stop_checkpointing();
 
+  // read the HTIF log at the start of a checkpoint, in either format
+  static bool read_checkpoint(std::istream& in, std::string& htif_log);
+
+  // append what the host sends from now on to to, or stop with NULL
+  void record_host(std::string* to) { host_record = to; }
+  // take what the host sends from a recording instead, and send it
+  // nothing. a copy of the simulator forked where the recording started
+  // can so run on through the same stretch without a host of its own.
+  void replay_host(const std::string& data);
+
 private:
   sim_t* sim;
   bool reset;
@@ -58,8 +70,28 @@ private:
   void setup_replay_state(replay_pkt_t*);
   bool checkpointing_active;
 
-  //std::fstream* checkpoint;
-  std::stringstream* checkpoint;
+  // the log is binary: tagged records of what to set up before the host's
+  // next request, with runs of plain ticks counted rather than listed.
+  // log_shadow holds the last value the log has each memory word take
+  // during replay, so setups that would not change anything are left out.
+  std::vector<uint64_t> checkpoint;
+  size_t last_tick; // where the record that ticks last is, or SIZE_MAX
+  std::unordered_map<reg_t, uint64_t> log_shadow;
+
+  void log_tick();
+  void log_setup(reg_t addr, const uint64_t* data, size_t n);
+  void log_write(reg_t addr, const uint64_t* data, size_t n);
+  void log_reg(uint64_t op, reg_t coreid, uint64_t val);
+  bool restore_binary_checkpoint(std::istream& restore);
+  bool restore_text_checkpoint(std::istream& restore);
+  void replay_store(reg_t addr, const uint64_t* data, size_t n);
+
+  std::string* host_record;
+  std::string host_replay;
+  size_t host_replay_pos;
+  bool host_replaying;
+  void host_recv(void* buf, size_t len);
+  void host_send(const void* buf, size_t len);
 
   void tick_once();
 };
@@ -2,18 +2,32 @@
 
 #include "insn_template.h"
 
-reg_t rv32_NAME(processor_t* p, insn_t insn, reg_t pc)
+// the body is instantiated once with the plain register and memory accessors
+// and once with the ones that report to the debug tracer and commit log
+template <class insn_policy_t, int xlen>
+static reg_t execute_NAME(processor_t* p, insn_t insn, reg_t pc)
 {
-  int xlen = 32;
   reg_t npc = sext_xlen(pc + insn_length(OPCODE));
   #include "insns/NAME.h"
   return npc;
 }
 
+reg_t rv32_NAME(processor_t* p, insn_t insn, reg_t pc)
+{
+  return execute_NAME<fast_policy_t, 32>(p, insn, pc);
+}
+
 reg_t rv64_NAME(processor_t* p, insn_t insn, reg_t pc)
 {
-  int xlen = 64;
-  reg_t npc = sext_xlen(pc + insn_length(OPCODE));
-  #include "insns/NAME.h"
-  return npc;
+  return execute_NAME<fast_policy_t, 64>(p, insn, pc);
+}
+
+reg_t rv32_NAME_traced(processor_t* p, insn_t insn, reg_t pc)
+{
+  return execute_NAME<traced_policy_t, 32>(p, insn, pc);
+}
+
+reg_t rv64_NAME_traced(processor_t* p, insn_t insn, reg_t pc)
+{
+  return execute_NAME<traced_policy_t, 64>(p, insn, pc);
 }
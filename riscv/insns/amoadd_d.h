@@ -1,4 +1,4 @@
 require_xpr64;
-reg_t v = MMU.load_uint64(RS1);
-MMU.store_uint64(RS1, RS2 + v);
+uint64_t rhs = RS2;
+uint64_t v = MMU.amo_uint64(RS1, [&](uint64_t lhs) { return uint64_t(lhs + rhs); });
 WRITE_RD(v);
@@ -1,3 +1,3 @@
-uint32_t v = MMU.load_int32(RS1);
-MMU.store_uint32(RS1, std::max(uint32_t(RS2),v));
+uint32_t rhs = RS2;
+uint32_t v = MMU.amo_uint32(RS1, [&](uint32_t lhs) { return uint32_t(std::max(lhs, rhs)); });
 WRITE_RD((int32_t)v);
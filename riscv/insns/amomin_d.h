@@ -1,4 +1,4 @@
 require_xpr64;
-sreg_t v = MMU.load_int64(RS1);
-MMU.store_uint64(RS1, std::min(sreg_t(RS2),v));
+uint64_t rhs = RS2;
+uint64_t v = MMU.amo_uint64(RS1, [&](uint64_t lhs) { return uint64_t(std::min(int64_t(lhs), int64_t(rhs))); });
 WRITE_RD(v);
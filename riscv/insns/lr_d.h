@@ -1,3 +1,4 @@
 require_xpr64;
 p->get_state()->load_reservation = RS1;
-WRITE_RD(MMU.load_int64(RS1));
+p->load_reservation_value = MMU.load_int64(RS1);
+WRITE_RD(p->load_reservation_value);
@@ -1,2 +1,3 @@
 p->get_state()->load_reservation = RS1;
-WRITE_RD(MMU.load_int32(RS1));
+p->load_reservation_value = MMU.load_int32(RS1);
+WRITE_RD(p->load_reservation_value);
@@ -1 +1,2 @@
-throw trap_breakpoint();
+p->post_trap(&p->breakpoint_trap);
+set_pc(pc);
@@ -1,7 +1,5 @@
-if (RS1 == p->get_state()->load_reservation)
-{
-  MMU.store_uint32(RS1, RS2);
+if (RS1 == p->get_state()->load_reservation &&
+    MMU.store_conditional_uint32(RS1, p->load_reservation_value, RS2))
   WRITE_RD(0);
-}
 else
   WRITE_RD(1);
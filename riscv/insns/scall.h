@@ -1 +1,2 @@
-throw trap_syscall();
+p->post_trap(&p->syscall_trap);
+set_pc(pc);
@@ -0,0 +1,456 @@
+// See LICENSE for license details.
+
+#include "jit.h"
+#include "mmu.h"
+#include "processor.h"
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+
+// translated code keeps the guest register file in rbx, the mmu in r12 and
+// the pc result pointer in r13; everything else is scratch between guest
+// instructions, which always go back to the register file in memory.
+enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6 };
+
+struct jit_load_t
+{
+  reg_t val;
+  reg_t ok;
+};
+
+#define jit_load_func(type) \
+  static jit_load_t jit_load_##type(mmu_t* mmu, reg_t addr) { \
+    void* paddr = mmu->translate_nofault(addr, sizeof(type##_t), false); \
+    if (unlikely(!paddr)) \
+      return (jit_load_t){0, 0}; \
+    return (jit_load_t){reg_t(*(type##_t*)paddr), 1}; \
+  }
+
+#define jit_store_func(type) \
+  static reg_t jit_store_##type(mmu_t* mmu, reg_t addr, reg_t val) { \
+    void* paddr = mmu->translate_nofault(addr, sizeof(type##_t), true); \
+    if (unlikely(!paddr)) \
+      return 0; \
+    *(type##_t*)paddr = val; \
+    return 1; \
+  }
+
+jit_load_func(uint8)
+jit_load_func(uint16)
+jit_load_func(uint32)
+jit_load_func(int8)
+jit_load_func(int16)
+jit_load_func(int32)
+jit_load_func(int64)
+
+jit_store_func(uint8)
+jit_store_func(uint16)
+jit_store_func(uint32)
+jit_store_func(uint64)
+
+jit_t::jit_t(mmu_t* _mmu)
+  : mmu(_mmu), code(NULL), code_used(0)
+{
+  void* p = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    fprintf(stderr, "Unable to map JIT code buffer; interpreting only\n");
+  else
+    code = (uint8_t*)p;
+}
+
+jit_t::~jit_t()
+{
+  if (code)
+    munmap(code, CODE_SIZE);
+}
+
+bool jit_t::supported()
+{
+  return true;
+}
+
+void jit_t::emit32(uint32_t x)
+{
+  memcpy(pos(), &x, sizeof(x));
+  code_used += sizeof(x);
+}
+
+void jit_t::emit64(uint64_t x)
+{
+  memcpy(pos(), &x, sizeof(x));
+  code_used += sizeof(x);
+}
+
+void jit_t::emit_bytes(const char* bytes, size_t n)
+{
+  memcpy(pos(), bytes, n);
+  code_used += n;
+}
+
+void jit_t::patch_rel32(size_t fixup)
+{
+  uint32_t rel = code_used - (fixup + 4);
+  memcpy(code + fixup, &rel, sizeof(rel));
+}
+
+// mov host_reg, [rbx + 8*guest_reg]
+void jit_t::load_xpr(int host_reg, size_t guest_reg)
+{
+  emit_bytes("\x48\x8b", 2);
+  emit8(0x83 | (host_reg << 3));
+  emit32(guest_reg * sizeof(reg_t));
+}
+
+// mov [rbx + 8*guest_reg], rax; writes to x0 are dropped
+void jit_t::store_xpr(size_t guest_reg)
+{
+  if (guest_reg == 0)
+    return;
+  emit_bytes("\x48\x89\x83", 3);
+  emit32(guest_reg * sizeof(reg_t));
+}
+
+// mov rdi, r12; mov rax, func; call rax
+void jit_t::call(const void* func)
+{
+  emit_bytes("\x4c\x89\xe7\x48\xb8", 5);
+  emit64((uint64_t)func);
+  emit_bytes("\xff\xd0", 2);
+}
+
+// mov [r13], rax; mov eax, idx; pop r13; pop r12; pop rbx; ret
+void jit_t::exit_block_with_rax(size_t idx)
+{
+  emit_bytes("\x49\x89\x45\x00\xb8", 5);
+  emit32(idx);
+  emit_bytes("\x41\x5d\x41\x5c\x5b\xc3", 6);
+}
+
+void jit_t::exit_block(size_t idx, reg_t pc)
+{
+  emit_bytes("\x48\xb8", 2);
+  emit64(pc);
+  exit_block_with_rax(idx);
+}
+
+enum { INSN_UNSUPPORTED, INSN_NEXT, INSN_EXITS };
+
+int jit_t::translate_insn(insn_t insn, reg_t pc, size_t idx, exit_t* side_exit)
+{
+  uint32_t bits = insn.bits();
+  reg_t npc = pc + insn_length(bits);
+  #define IS(name) ((bits & MASK_##name) == MATCH_##name)
+
+  // reg-reg operations: rax = rs1, rcx = rs2, then op rax, rcx
+  static const struct { uint32_t match, mask; const char* op; size_t len; bool w; } alu[] = {
+    { MATCH_ADD, MASK_ADD, "\x48\x01\xc8", 3, false },
+    { MATCH_SUB, MASK_SUB, "\x48\x29\xc8", 3, false },
+    { MATCH_AND, MASK_AND, "\x48\x21\xc8", 3, false },
+    { MATCH_OR, MASK_OR, "\x48\x09\xc8", 3, false },
+    { MATCH_XOR, MASK_XOR, "\x48\x31\xc8", 3, false },
+    { MATCH_SLL, MASK_SLL, "\x48\xd3\xe0", 3, false },
+    { MATCH_SRL, MASK_SRL, "\x48\xd3\xe8", 3, false },
+    { MATCH_SRA, MASK_SRA, "\x48\xd3\xf8", 3, false },
+    { MATCH_MUL, MASK_MUL, "\x48\x0f\xaf\xc1", 4, false },
+    { MATCH_SLT, MASK_SLT, "\x48\x39\xc8\x0f\x9c\xc0\x0f\xb6\xc0", 9, false },
+    { MATCH_SLTU, MASK_SLTU, "\x48\x39\xc8\x0f\x92\xc0\x0f\xb6\xc0", 9, false },
+    { MATCH_ADDW, MASK_ADDW, "\x01\xc8", 2, true },
+    { MATCH_SUBW, MASK_SUBW, "\x29\xc8", 2, true },
+    { MATCH_SLLW, MASK_SLLW, "\xd3\xe0", 2, true },
+    { MATCH_SRLW, MASK_SRLW, "\xd3\xe8", 2, true },
+    { MATCH_SRAW, MASK_SRAW, "\xd3\xf8", 2, true },
+    { MATCH_MULW, MASK_MULW, "\x0f\xaf\xc1", 3, true },
+  };
+  for (size_t i = 0; i < sizeof(alu)/sizeof(alu[0]); i++)
+  {
+    if ((bits & alu[i].mask) != alu[i].match)
+      continue;
+    load_xpr(RAX, insn.rs1());
+    load_xpr(RCX, insn.rs2());
+    emit_bytes(alu[i].op, alu[i].len);
+    if (alu[i].w)
+      emit_bytes("\x48\x63\xc0", 3); // movsxd rax, eax
+    store_xpr(insn.rd());
+    return INSN_NEXT;
+  }
+
+  // reg-imm operations: rax = rs1, then op rax, imm32
+  static const struct { uint32_t match, mask; const char* op; size_t len; bool w; } alu_imm[] = {
+    { MATCH_ADDI, MASK_ADDI, "\x48\x05", 2, false },
+    { MATCH_ANDI, MASK_ANDI, "\x48\x25", 2, false },
+    { MATCH_ORI, MASK_ORI, "\x48\x0d", 2, false },
+    { MATCH_XORI, MASK_XORI, "\x48\x35", 2, false },
+    { MATCH_SLTI, MASK_SLTI, "\x48\x3d", 2, false },
+    { MATCH_SLTIU, MASK_SLTIU, "\x48\x3d", 2, false },
+    { MATCH_ADDIW, MASK_ADDIW, "\x05", 1, true },
+  };
+  for (size_t i = 0; i < sizeof(alu_imm)/sizeof(alu_imm[0]); i++)
+  {
+    if ((bits & alu_imm[i].mask) != alu_imm[i].match)
+      continue;
+    load_xpr(RAX, insn.rs1());
+    emit_bytes(alu_imm[i].op, alu_imm[i].len);
+    emit32(insn.i_imm());
+    if (IS(SLTI))
+      emit_bytes("\x0f\x9c\xc0\x0f\xb6\xc0", 6); // setl al; movzx eax, al
+    else if (IS(SLTIU))
+      emit_bytes("\x0f\x92\xc0\x0f\xb6\xc0", 6); // setb al; movzx eax, al
+    if (alu_imm[i].w)
+      emit_bytes("\x48\x63\xc0", 3);
+    store_xpr(insn.rd());
+    return INSN_NEXT;
+  }
+
+  // shifts by an immediate: rax = rs1, then shift rax, imm8. the 32-bit
+  // forms with shamt[5] set are left to the interpreter, which is where
+  // their (reserved) behaviour is defined.
+  static const struct { uint32_t match, mask; const char* op; size_t len; bool w; } shift_imm[] = {
+    { MATCH_SLLI, MASK_SLLI, "\x48\xc1\xe0", 3, false },
+    { MATCH_SRLI, MASK_SRLI, "\x48\xc1\xe8", 3, false },
+    { MATCH_SRAI, MASK_SRAI, "\x48\xc1\xf8", 3, false },
+    { MATCH_SLLIW, MASK_SLLIW, "\xc1\xe0", 2, true },
+    { MATCH_SRLIW, MASK_SRLIW, "\xc1\xe8", 2, true },
+    { MATCH_SRAIW, MASK_SRAIW, "\xc1\xf8", 2, true },
+  };
+  for (size_t i = 0; i < sizeof(shift_imm)/sizeof(shift_imm[0]); i++)
+  {
+    if ((bits & shift_imm[i].mask) != shift_imm[i].match)
+      continue;
+    size_t shamt = insn.i_imm() & 0x3F;
+    if (shift_imm[i].w && (shamt & 0x20))
+      return INSN_UNSUPPORTED;
+    load_xpr(RAX, insn.rs1());
+    emit_bytes(shift_imm[i].op, shift_imm[i].len);
+    emit8(shamt);
+    if (shift_imm[i].w)
+      emit_bytes("\x48\x63\xc0", 3);
+    store_xpr(insn.rd());
+    return INSN_NEXT;
+  }
+
+  if (IS(LUI) || IS(AUIPC))
+  {
+    emit_bytes("\x48\xb8", 2); // mov rax, imm64
+    emit64(insn.u_imm() + (IS(AUIPC) ? pc : 0));
+    store_xpr(insn.rd());
+    return INSN_NEXT;
+  }
+
+  // loads and stores call a TLB probe and leave through a side exit when
+  // it misses, so the interpreter can refill the TLB or take the trap
+  static const struct { uint32_t match, mask; const void* func; } mem[] = {
+    { MATCH_LB, MASK_LB, (const void*)jit_load_int8 },
+    { MATCH_LH, MASK_LH, (const void*)jit_load_int16 },
+    { MATCH_LW, MASK_LW, (const void*)jit_load_int32 },
+    { MATCH_LD, MASK_LD, (const void*)jit_load_int64 },
+    { MATCH_LBU, MASK_LBU, (const void*)jit_load_uint8 },
+    { MATCH_LHU, MASK_LHU, (const void*)jit_load_uint16 },
+    { MATCH_LWU, MASK_LWU, (const void*)jit_load_uint32 },
+    { MATCH_SB, MASK_SB, (const void*)jit_store_uint8 },
+    { MATCH_SH, MASK_SH, (const void*)jit_store_uint16 },
+    { MATCH_SW, MASK_SW, (const void*)jit_store_uint32 },
+    { MATCH_SD, MASK_SD, (const void*)jit_store_uint64 },
+  };
+  for (size_t i = 0; i < sizeof(mem)/sizeof(mem[0]); i++)
+  {
+    if ((bits & mem[i].mask) != mem[i].match)
+      continue;
+    bool store = insn.opcode() == OP_STORE;
+    load_xpr(RSI, insn.rs1());
+    emit_bytes("\x48\x81\xc6", 3); // add rsi, imm32
+    emit32(store ? insn.s_imm() : insn.i_imm());
+    if (store)
+      load_xpr(RDX, insn.rs2());
+    call(mem[i].func);
+    // test eax, eax / test rdx, rdx; jz side exit
+    emit_bytes(store ? "\x85\xc0\x0f\x84" : "\x48\x85\xd2\x0f\x84", store ? 4 : 5);
+    *side_exit = (exit_t){code_used, idx, pc};
+    emit32(0);
+    if (!store)
+      store_xpr(insn.rd());
+    return INSN_NEXT;
+  }
+
+  // conditional branches: cmp rs1, rs2 and jump over the taken exit on the
+  // inverse condition
+  static const struct { uint32_t match, mask; uint8_t jcc_not_taken; } branch[] = {
+    { MATCH_BEQ, MASK_BEQ, 0x85 },
+    { MATCH_BNE, MASK_BNE, 0x84 },
+    { MATCH_BLT, MASK_BLT, 0x8d },
+    { MATCH_BGE, MASK_BGE, 0x8c },
+    { MATCH_BLTU, MASK_BLTU, 0x83 },
+    { MATCH_BGEU, MASK_BGEU, 0x82 },
+  };
+  for (size_t i = 0; i < sizeof(branch)/sizeof(branch[0]); i++)
+  {
+    if ((bits & branch[i].mask) != branch[i].match)
+      continue;
+    load_xpr(RAX, insn.rs1());
+    load_xpr(RCX, insn.rs2());
+    emit_bytes("\x48\x39\xc8\x0f", 4);
+    emit8(branch[i].jcc_not_taken);
+    size_t fixup = code_used;
+    emit32(0);
+    exit_block(idx + 1, pc + insn.sb_imm());
+    patch_rel32(fixup);
+    exit_block(idx + 1, npc);
+    return INSN_EXITS;
+  }
+
+  if (IS(JAL))
+  {
+    emit_bytes("\x48\xb8", 2);
+    emit64(npc);
+    store_xpr(insn.rd());
+    exit_block(idx + 1, pc + insn.uj_imm());
+    return INSN_EXITS;
+  }
+
+  if (IS(JALR))
+  {
+    // the target is computed before rd is written, as rd may be rs1
+    load_xpr(RCX, insn.rs1());
+    emit_bytes("\x48\x81\xc1", 3); // add rcx, imm32
+    emit32(insn.i_imm());
+    emit_bytes("\x48\x83\xe1\xfe\x48\xb8", 6); // and rcx, -2; mov rax, imm64
+    emit64(npc);
+    store_xpr(insn.rd());
+    emit_bytes("\x48\x89\xc8", 3); // mov rax, rcx
+    exit_block_with_rax(idx + 1);
+    return INSN_EXITS;
+  }
+
+  #undef IS
+  return INSN_UNSUPPORTED;
+}
+
+jit_block_t jit_t::translate(reg_t pc, bb_cache_entry_t* bb)
+{
+  if (!code)
+    return NULL;
+
+  if (code_used + MAX_BLOCK_CODE > CODE_SIZE)
+  {
+    // translations are only reachable through decoded blocks, so dropping
+    // those is enough to forget all of them
+    mmu->flush_icache();
+    code_used = 0;
+    return NULL;
+  }
+
+  size_t start = code_used;
+  // push rbx; push r12; push r13; mov rbx, rdi; mov r12, rsi; mov r13, rdx
+  emit_bytes("\x53\x41\x54\x41\x55\x48\x89\xfb\x49\x89\xf4\x49\x89\xd5", 14);
+
+  exit_t side_exits[BB_MAX_INSNS];
+  size_t nexits = 0;
+  size_t idx = 0;
+  int result = INSN_NEXT;
+  for ( ; idx < bb->ninsns && result == INSN_NEXT; idx++)
+  {
+    insn_t insn = bb->data[idx].insn;
+    side_exits[nexits].fixup = 0;
+    result = translate_insn(insn, pc, idx, &side_exits[nexits]);
+    if (result == INSN_UNSUPPORTED)
+      break;
+    if (side_exits[nexits].fixup)
+      nexits++;
+    if (result == INSN_NEXT)
+      pc += insn_length(insn.bits());
+  }
+
+  if (idx == 0)
+  {
+    code_used = start;
+    return NULL;
+  }
+
+  // fall out of the block at the first instruction not translated
+  if (result != INSN_EXITS)
+    exit_block(idx, pc);
+
+  for (size_t i = 0; i < nexits; i++)
+  {
+    patch_rel32(side_exits[i].fixup);
+    exit_block(side_exits[i].idx, side_exits[i].pc);
+  }
+
+  return (jit_block_t)(code + start);
+}
+
+#else
+
+jit_t::jit_t(mmu_t* _mmu)
+  : mmu(_mmu), code(NULL), code_used(0)
+{
+}
+
+jit_t::~jit_t()
+{
+}
+
+bool jit_t::supported()
+{
+  return false;
+}
+
+jit_block_t jit_t::translate(reg_t pc, bb_cache_entry_t* bb)
+{
+  return NULL;
+}
+
+#endif
+
+void processor_t::step_jit(reg_t& pc_ref, size_t& instret_ref, size_t n)
+{
+  reg_t* xpr = const_cast<reg_t*>(&state.XPR[0]);
+  reg_t pc = pc_ref;
+  size_t retired = instret_ref;
+  insn_fetch_t* fetch = NULL;
+  insn_fetch_t* block = NULL;
+
+  try
+  {
+    // translations assume RV64, so leave any change of xlen to step(), as
+    // well as delivering posted traps
+    while (retired < n && rv64 && likely(!pending_trap))
+    {
+      bb_cache_entry_t* bb = mmu->access_bb_cache(pc);
+      if (unlikely(bb->ninsns > n - retired))
+        break;
+
+      block = fetch = bb->data;
+      insn_fetch_t* end = block + bb->ninsns;
+      live_instret = retired + bb->ninsns - 1;
+
+      if (unlikely(!bb->jit) && ++bb->hits == jit_t::HOT_THRESHOLD)
+        bb->jit = jit->translate(pc, bb);
+      if (bb->jit)
+        fetch += bb->jit(xpr, mmu, &pc);
+
+      // interpret whatever the translation stopped short of, up to an
+      // access that faults
+      for ( ; fetch != end; fetch++)
+      {
+        reg_t npc = fetch->func(this, fetch->insn, pc);
+        if (insn_faulted())
+          break;
+        pc = npc;
+      }
+
+      retired += fetch - block;
+      block = fetch = NULL;
+    }
+  }
+  catch (...)
+  {
+    pc_ref = pc;
+    instret_ref = retired + (fetch - block);
+    throw;
+  }
+
+  pc_ref = pc;
+  instret_ref = retired;
+}
@@ -0,0 +1,62 @@
+// See LICENSE for license details.
+#ifndef _RISCV_JIT_H
+#define _RISCV_JIT_H
+
+#include "decode.h"
+#include <stdint.h>
+
+class mmu_t;
+struct bb_cache_entry_t;
+
+// a translated basic block. it runs the block's instructions in order until
+// one it cannot complete on its own, stores the pc of that instruction (or
+// of the block's successor) to *pc, and returns its index in the block.
+typedef size_t (*jit_block_t)(reg_t* xpr, mmu_t* mmu, reg_t* pc);
+
+// translates hot RV64I basic blocks into x86-64 host code. loads and stores
+// only probe the TLB; a miss, like any instruction the translator does not
+// handle, leaves the rest of the block to the interpreter.
+class jit_t
+{
+public:
+  jit_t(mmu_t* _mmu);
+  ~jit_t();
+
+  // whether this host can run translated code at all
+  static bool supported();
+
+  // translate the block cached in bb, which starts at pc. returns NULL if
+  // nothing in it could be translated.
+  jit_block_t translate(reg_t pc, bb_cache_entry_t* bb);
+
+  // executions of a block before it is worth translating
+  static const size_t HOT_THRESHOLD = 16;
+
+private:
+  mmu_t* mmu;
+  uint8_t* code;
+  size_t code_used;
+
+  static const size_t CODE_SIZE = 16 << 20;
+  static const size_t MAX_BLOCK_CODE = 4096;
+
+  // pending forward jumps to the side exit of an instruction
+  struct exit_t { size_t fixup; size_t idx; reg_t pc; };
+
+  uint8_t* pos() { return code + code_used; }
+  void emit8(uint8_t x) { code[code_used++] = x; }
+  void emit32(uint32_t x);
+  void emit64(uint64_t x);
+  void emit_bytes(const char* bytes, size_t n);
+  void patch_rel32(size_t fixup);
+
+  void load_xpr(int host_reg, size_t guest_reg);
+  void store_xpr(size_t guest_reg);
+  void call(const void* func);
+  void exit_block(size_t idx, reg_t pc);
+  void exit_block_with_rax(size_t idx);
+
+  int translate_insn(insn_t insn, reg_t pc, size_t idx, exit_t* side_exit);
+};
+
+#endif
@@ -4,9 +4,19 @@
 #define _MEMTRACER_H
 
 #include <cstdint>
+#include <algorithm>
 #include <string.h>
 #include <vector>
 
+// one access as the mmu records it, to hand to the tracers later on
+struct mem_event_t
+{
+  uint64_t addr;
+  uint32_t bytes;
+  bool store;
+  bool fetch;
+};
+
 class memtracer_t
 {
  public:
@@ -15,6 +25,18 @@ class memtracer_t
 
   virtual bool interested_in_range(uint64_t begin, uint64_t end, bool store, bool fetch) = 0;
   virtual void trace(uint64_t addr, size_t bytes, bool store, bool fetch) = 0;
+  // instruction fetches are traced once each time fetch moves into another
+  // aligned block of this many bytes, rather than once per instruction,
+  // for tracers that only tell blocks apart anyway. 0 asks for all of them.
+  virtual size_t fetch_block() { return 0; }
+  // a batch of accesses, in order, of which only those the tracer is
+  // interested in are traced
+  virtual void trace(const mem_event_t* events, size_t n)
+  {
+    for (const mem_event_t* e = events; e != events + n; e++)
+      if (interested_in_range(e->addr, e->addr + e->bytes, e->store, e->fetch))
+        trace(e->addr, e->bytes, e->store, e->fetch);
+  }
 };
 
 class memtracer_list_t : public memtracer_t
@@ -33,6 +55,25 @@ class memtracer_list_t : public memtracer_t
     for (std::vector<memtracer_t*>::iterator it = list.begin(); it != list.end(); ++it)
       (*it)->trace(addr, bytes, store, fetch);
   }
+  void trace(const mem_event_t* events, size_t n)
+  {
+    if (list.size() == 1)
+      return list[0]->trace(events, n);
+    // event by event, as tracers may share caches further down
+    for (const mem_event_t* e = events; e != events + n; e++)
+      for (std::vector<memtracer_t*>::iterator it = list.begin(); it != list.end(); ++it)
+        if ((*it)->interested_in_range(e->addr, e->addr + e->bytes, e->store, e->fetch))
+          (*it)->trace(e->addr, e->bytes, e->store, e->fetch);
+  }
+  // the largest block size that all tracers interested in fetches accept
+  size_t fetch_block()
+  {
+    size_t block = SIZE_MAX;
+    for (std::vector<memtracer_t*>::iterator it = list.begin(); it != list.end(); ++it)
+      if ((*it)->interested_in_range(0, UINT64_MAX, false, true))
+        block = std::min(block, (*it)->fetch_block());
+    return block == SIZE_MAX ? 0 : block;
+  }
   void hook(memtracer_t* h)
   {
     list.push_back(h);
@@ -3,15 +3,18 @@
 #include "mmu.h"
 #include "sim.h"
 #include "processor.h"
+#include "decoder.h"
 
 extern bool logging_on;
 
-mmu_t::mmu_t(char* _mem, size_t _memsz)
- : mem(_mem), memsz(_memsz), proc(NULL)
+mmu_t::mmu_t(target_mem_t* _target_mem)
+ : target_mem(_target_mem), mem(_target_mem->data()),
+   memsz(_target_mem->size()), proc(NULL), tracing(false), trace_used(0),
+   fetch_block_mask(0), last_fetch_block(-1), concurrent(false),
+   post_faults(false), decode_cache(NULL)
 {
-#ifdef RISCV_ENABLE_DBG_TRACE
+  set_supervisor(false);
   insn_tracer = nullptr;
-#endif
   flush_tlb();
 }
 
@@ -22,7 +25,105 @@ mmu_t::~mmu_t()
 void mmu_t::flush_icache()
 {
   for (size_t i = 0; i < ICACHE_ENTRIES; i++)
-    icache[i].tag = -1;
+    icaches[0][i].tag = icaches[1][i].tag = -1;
+  for (size_t i = 0; i < BB_CACHE_ENTRIES; i++)
+    bb_caches[0][i].tag = bb_caches[1][i].tag = -1;
+}
+
+void mmu_t::fence_i()
+{
+  flush_icache();
+  if (decode_cache)
+    decode_cache->flush();
+}
+
+void mmu_t::set_decode_cache(decode_cache_t* cache)
+{
+  decode_cache = cache;
+  flush_icache();
+}
+
+insn_fetch_t mmu_t::fetch_shared(char* iaddr)
+{
+  // the generation has to be read before the instruction, so that one
+  // fetched from before a flush is filed under the old generation
+  reg_t paddr = iaddr - mem;
+  uint64_t gen = decode_cache->get_generation();
+  insn_bits_t insn;
+  const insn_desc_t* desc;
+  if (!decode_cache->lookup(paddr, proc->decoder, gen, &insn, &desc))
+  {
+    size_t len = insn_length(*(uint16_t*)iaddr);
+    insn = 0;
+    for (size_t i = 0; i < len; i += 2)
+      insn |= (insn_bits_t)*(uint16_t*)(iaddr + i) << (8*i);
+    if (len < sizeof(insn_bits_t))
+      insn = (int64_t)(insn << (64 - 8*len)) >> (64 - 8*len);
+
+    desc = proc->decoder->decode(insn);
+    decode_cache->insert(paddr, proc->decoder, gen, insn, desc);
+  }
+  return (insn_fetch_t){proc->handler(desc), insn};
+}
+
+// instructions that can redirect control flow or change the state decoded
+// blocks depend on (CSRs, fence.i, traps, extension opcodes) end a block
+static bool ends_basic_block(insn_t insn)
+{
+  if (insn.length() != 4)
+    return true;
+
+  switch (insn.opcode())
+  {
+    case OP_LUI:
+    case OP_AUIPC:
+    case OP_LOAD:
+    case OP_STORE:
+    case OP_OP_IMM:
+    case OP_OP_IMM_32:
+    case OP_OP:
+    case OP_OP_32:
+    case OP_MADD:
+    case OP_MSUB:
+    case OP_NMSUB:
+    case OP_NMADD:
+    case OP_OP_FP:
+    case OP_LOAD_FP:
+    case OP_STORE_FP:
+      return false;
+    default:
+      return true;
+  }
+}
+
+bb_cache_entry_t* mmu_t::refill_bb_cache(reg_t addr)
+{
+  bb_cache_entry_t* entry = &bb_cache[bb_cache_index(addr)];
+  entry->tag = -1;
+  entry->ninsns = 0;
+  entry->threaded[0] = NULL;
+  entry->jit = NULL;
+  entry->hits = 0;
+
+  // only the first instruction may fault on fetch: the block stops short
+  // of the end of the page so that later fetches never touch another one
+  reg_t page_base = addr & ~(PGSIZE-1);
+  for (reg_t pc = addr; ; )
+  {
+    char* iaddr;
+    insn_fetch_t fetch = fetch_insn(pc, &iaddr);
+    entry->data[entry->ninsns++] = fetch;
+    if (unlikely(fetch.func == &faulted_fetch))
+      return entry; // run once, and looked up again after the trap
+    pc += fetch.insn.length();
+
+    if (ends_basic_block(fetch.insn) || entry->ninsns == BB_MAX_INSNS ||
+        pc - page_base > PGSIZE - sizeof(insn_bits_t))
+      break;
+  }
+
+  entry->tag = addr;
+  return entry;
 }
 
 void mmu_t::flush_tlb()
@@ -34,10 +135,15 @@ void mmu_t::flush_tlb()
   flush_icache();
 }
 
+void mmu_t::flush_store_tlb()
+{
+  memset(tlb_store_tag, -1, sizeof(tlb_store_tag));
+}
+
 void* mmu_t::refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch)
 {
   reg_t idx = (addr >> PGSHIFT) % TLB_ENTRIES;
-  reg_t expected_tag = addr >> PGSHIFT;
+  reg_t expected_tag = (addr >> PGSHIFT) | tlb_priv;
 
   reg_t pte = walk(addr);
 
@@ -50,31 +156,48 @@ void* mmu_t::refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch)
   ifprintf(logging_on,stderr,"PTE Perm 0x%" PRIxreg "  Perm 0x%" PRIxreg "\n",pte_perm,perm);
 
   if(unlikely((pte_perm & perm) != perm))
-  {
-    if (fetch)
-      throw trap_instruction_access_fault(addr);
-    if (store)
-      throw trap_store_access_fault(addr);
-    throw trap_load_access_fault(addr);
-  }
+    return fault(fetch ? CAUSE_FAULT_FETCH :
+                 store ? CAUSE_FAULT_STORE : CAUSE_FAULT_LOAD, addr);
 
   reg_t pgoff = addr & (PGSIZE-1);
   reg_t pgbase = pte >> PGSHIFT << PGSHIFT;
   reg_t paddr = pgbase + pgoff;
 
-  if (unlikely(tracer.interested_in_range(pgbase, pgbase + PGSIZE, store, fetch)))
-    tracer.trace(paddr, bytes, store, fetch);
-  else
-  {
-    tlb_load_tag[idx] = (pte_perm & PTE_UR) ? expected_tag : -1;
-    tlb_store_tag[idx] = (pte_perm & PTE_UW) ? expected_tag : -1;
-    tlb_insn_tag[idx] = (pte_perm & PTE_UX) ? expected_tag : -1;
-    tlb_data[idx] = mem + pgbase - (addr & ~(PGSIZE-1));
-  }
+  // stores only skip refills once the page is known to be dirty
+  if (store)
+    target_mem->mark_written(pgbase);
+  bool writable = (pte_perm & PTE_UW) && target_mem->page_dirty(pgbase);
+
+  tlb_load_tag[idx] = (pte_perm & PTE_UR) ? expected_tag : -1;
+  tlb_store_tag[idx] = writable ? expected_tag : -1;
+  tlb_insn_tag[idx] = (pte_perm & PTE_UX) ? expected_tag : -1;
+  tlb_data[idx] = mem + pgbase - (addr & ~(PGSIZE-1));
 
   return mem + paddr;
 }
 
+reg_t faulted_fetch(processor_t* p, insn_t insn, reg_t pc)
+{
+  return pc;
+}
+
+void* mmu_t::fault(reg_t cause, reg_t addr)
+{
+  if (!post_faults)
+    switch (cause)
+    {
+      case CAUSE_MISALIGNED_FETCH: throw trap_instruction_address_misaligned(addr);
+      case CAUSE_FAULT_FETCH: throw trap_instruction_access_fault(addr);
+      case CAUSE_MISALIGNED_LOAD: throw trap_load_address_misaligned(addr);
+      case CAUSE_FAULT_LOAD: throw trap_load_access_fault(addr);
+      case CAUSE_MISALIGNED_STORE: throw trap_store_address_misaligned(addr);
+      default: throw trap_store_access_fault(addr);
+    }
+
+  proc->post_fault(cause, addr);
+  return fault_scratch;
+}
+
 pte_t mmu_t::walk(reg_t addr)
 {
   pte_t pte = 0;
@@ -128,6 +251,35 @@ pte_t mmu_t::walk(reg_t addr)
 
 void mmu_t::register_memtracer(memtracer_t* t)
 {
-  flush_tlb();
+  flush_trace();
   tracer.hook(t);
+  tracing = true;
+  size_t block = tracer.fetch_block();
+  fetch_block_mask = block ? ~reg_t(block - 1) : 0;
+  last_fetch_block = -1;
+}
+
+// the mmu whose accesses the tracers saw last
+static std::atomic<const mmu_t*> last_traced(NULL);
+
+void mmu_t::flush_trace()
+{
+  if (trace_used == 0)
+    return;
+  tracer.trace(trace_events, trace_used);
+  trace_used = 0;
+  last_traced.store(this, std::memory_order_relaxed);
+}
+
+void mmu_t::resume_trace()
+{
+  if (last_traced.load(std::memory_order_relaxed) != this)
+    last_fetch_block = -1;
+}
+
+void mmu_t::pause_trace(bool value)
+{
+  flush_trace();
+  tracing = !value && !tracer.empty();
+  last_fetch_block = -1;
 }
@@ -8,8 +8,10 @@
 #include "common.h"
 #include "config.h"
 #include "processor.h"
+#include "jit.h"
 #include "memtracer.h"
 #include "debug_tracer.h"
+#include "target_mem.h"
 #include <vector>
 
 // virtual memory configuration
@@ -22,63 +24,83 @@ const reg_t VPN_BITS = PTIDXBITS * LEVELS;
 const reg_t PPN_BITS = 8*sizeof(reg_t) - PGSHIFT;
 const reg_t VA_BITS = VPN_BITS + PGSHIFT;
 
+class decode_cache_t;
+
 struct insn_fetch_t
 {
   insn_func_t func;
   insn_t insn;
 };
 
+// what a fetch that posted its fault decodes to: it stays where it is
+reg_t faulted_fetch(processor_t* p, insn_t insn, reg_t pc);
+
 struct icache_entry_t {
   reg_t tag;
-  reg_t pad;
+  reg_t paddr; // where data was fetched from, for the tracers
   insn_fetch_t data;
 };
 
+// a run of pre-decoded instructions ending at the first control-flow or
+// CSR instruction, so the step loop only checks its budget once per block
+const size_t BB_MAX_INSNS = 16;
+
+struct bb_cache_entry_t {
+  reg_t tag;
+  size_t ninsns;
+  insn_fetch_t data[BB_MAX_INSNS];
+  // handler labels for the threaded dispatcher, filled in on first use and
+  // terminated by the label that ends the block; NULL until then
+  const void* threaded[BB_MAX_INSNS + 1];
+  // host code for the block once it has run jit_t::HOT_THRESHOLD times
+  jit_block_t jit;
+  size_t hits;
+};
+
 // this class implements a processor's port into the virtual memory system.
 // an MMU and instruction cache are maintained for simulator performance.
 class mmu_t
 {
 public:
-  mmu_t(char* _mem, size_t _memsz);
+  mmu_t(target_mem_t* _target_mem);
   ~mmu_t();
-#ifdef RISCV_ENABLE_DBG_TRACE
   // template for functions that load an aligned value from memory
   #define load_func(type) \
     type##_t load_##type(reg_t addr) __attribute__((always_inline)) { \
-      if (likely(insn_tracer != nullptr)) \
-        insn_tracer->trace_before_dc_translate(addr, sizeof(type##_t), false); \
       void* paddr = translate(addr, sizeof(type##_t), false, false); \
-      auto load_val = *(type##_t*)paddr; \
-      if (likely(insn_tracer != nullptr)) \
-        insn_tracer->trace_after_dc_access(addr, ((uintptr_t)paddr - (uintptr_t)mem), load_val, sizeof(type##_t), false); \
-      return load_val; \
+      trace_access(paddr, sizeof(type##_t), false); \
+      return *(type##_t*)paddr; \
     }
 
   // template for functions that store an aligned value to memory
   #define store_func(type) \
     void store_##type(reg_t addr, type##_t val) { \
-      if (likely(insn_tracer != nullptr)) \
-        insn_tracer->trace_before_dc_translate(addr, sizeof(type##_t), true); \
       void* paddr = translate(addr, sizeof(type##_t), true, false); \
+      trace_access(paddr, sizeof(type##_t), true); \
       *(type##_t*)paddr = val; \
-      if (likely(insn_tracer != nullptr)) \
-        insn_tracer->trace_after_dc_access(addr, ((uintptr_t)paddr - (uintptr_t)mem), val, sizeof(type##_t), true); \
     }
-#else
-  // template for functions that load an aligned value from memory
-  #define load_func(type) \
-    type##_t load_##type(reg_t addr) __attribute__((always_inline)) { \
+
+  // template for functions that replace an aligned value with f(old value)
+  // in one indivisible step and return the old value. faults are checked as
+  // for a load followed by a store.
+  #define amo_func(type) \
+    template <class op> type##_t amo_##type(reg_t addr, op f) { \
       void* paddr = translate(addr, sizeof(type##_t), false, false); \
-      return *(type##_t*)paddr; \
+      trace_access(paddr, sizeof(type##_t), false); \
+      if (likely(paddr != fault_scratch)) \
+        paddr = translate(addr, sizeof(type##_t), true, false); \
+      trace_access(paddr, sizeof(type##_t), true); \
+      return atomic_update((type##_t*)paddr, f); \
     }
 
-  // template for functions that store an aligned value to memory
-  #define store_func(type) \
-    void store_##type(reg_t addr, type##_t val) { \
+  // template for functions that store an aligned value only if memory still
+  // holds expected, and report whether they did
+  #define store_conditional_func(type) \
+    bool store_conditional_##type(reg_t addr, type##_t expected, type##_t val) { \
       void* paddr = translate(addr, sizeof(type##_t), true, false); \
-      *(type##_t*)paddr = val; \
+      trace_access(paddr, sizeof(type##_t), true); \
+      return atomic_replace((type##_t*)paddr, expected, val); \
     }
-#endif
 
   // load value from memory at aligned address; zero extend to register width
   load_func(uint8)
@@ -98,7 +120,14 @@ public:
   store_func(uint32)
   store_func(uint64)
 
+  // atomic memory operations, and the store half of LR/SC
+  amo_func(uint32)
+  amo_func(uint64)
+  store_conditional_func(uint32)
+  store_conditional_func(uint64)
+
   static const reg_t ICACHE_ENTRIES = 1024;
+  static const reg_t BB_CACHE_ENTRIES = 512;
 
   inline size_t icache_index(reg_t addr)
   {
@@ -106,53 +135,68 @@ public:
     return (addr / 4) % ICACHE_ENTRIES;
   }
 
+  inline size_t bb_cache_index(reg_t addr)
+  {
+    return (addr / 4) % BB_CACHE_ENTRIES;
+  }
+
+  // look up the basic block starting at addr, decoding it on a miss.
+  bb_cache_entry_t* access_bb_cache(reg_t addr) __attribute__((always_inline))
+  {
+    bb_cache_entry_t* entry = &bb_cache[bb_cache_index(addr)];
+    if (likely(entry->tag == addr))
+      return entry;
+    return refill_bb_cache(addr);
+  }
+
+  // look addr up in the TLB without refilling it or raising a trap;
+  // NULL means the access has to go through translate instead
+  void* translate_nofault(reg_t addr, reg_t bytes, bool store)
+  {
+    reg_t idx = (addr >> PGSHIFT) % TLB_ENTRIES;
+    reg_t tag = (store ? tlb_store_tag : tlb_load_tag)[idx];
+    if (unlikely(addr & (bytes-1)) || unlikely(tag != ((addr >> PGSHIFT) | tlb_priv)))
+      return NULL;
+    return tlb_data[idx] + addr;
+  }
+
   // load instruction from memory at aligned address.
   icache_entry_t* access_icache(reg_t addr) __attribute__((always_inline))
   {
-#ifdef RISCV_ENABLE_DBG_TRACE
-//    if (likely(insn_tracer != nullptr))
-      insn_tracer->trace_before_insn_ic_fetch(addr);
-#endif
-
     reg_t idx = icache_index(addr);
     icache_entry_t* entry = &icache[idx];
     if (likely(entry->tag == addr))
       return entry;
 
-    bool rvc = false; // set this dynamically once RVC is re-implemented
-    char* iaddr = (char*)translate(addr, rvc ? 2 : 4, false, true);
-    insn_bits_t insn = *(uint16_t*)iaddr;
-
-    if (unlikely(insn_length(insn) == 2)) {
-      insn = (int16_t)insn;
-    } else if (likely(insn_length(insn) == 4)) {
-      if (likely((addr & (PGSIZE-1)) < PGSIZE-2))
-        insn |= (insn_bits_t)*(int16_t*)(iaddr + 2) << 16;
-      else
-        insn |= (insn_bits_t)*(int16_t*)translate(addr + 2, 2, false, true) << 16;
-    } else if (insn_length(insn) == 6) {
-      insn |= (insn_bits_t)*(int16_t*)translate(addr + 4, 2, false, true) << 32;
-      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 2, false, true) << 16;
-    } else {
-      static_assert(sizeof(insn_bits_t) == 8, "insn_bits_t must be uint64_t");
-      insn |= (insn_bits_t)*(int16_t*)translate(addr + 6, 2, false, true) << 48;
-      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 4, 2, false, true) << 32;
-      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 2, false, true) << 16;
-    }
-
-    insn_fetch_t fetch = {proc->decode_insn(insn), insn};
-    icache[idx].tag = addr;
+    char* iaddr;
+    insn_fetch_t fetch = fetch_insn(addr, &iaddr);
+    icache[idx].tag = fetch.func == &faulted_fetch ? -1 : addr;
+    icache[idx].paddr = iaddr - mem;
     icache[idx].data = fetch;
+    return &icache[idx];
+  }
 
-    reg_t paddr = iaddr - mem;
-    if (!tracer.empty() && tracer.interested_in_range(paddr, paddr + 1, false, true))
+  // record the fetch of entry's instruction for the tracers, unless it
+  // comes from the same block as the one fetched before
+  void trace_fetch(icache_entry_t* entry) __attribute__((always_inline))
+  {
+    reg_t block = entry->paddr & fetch_block_mask;
+    if (unlikely(tracing) && block != last_fetch_block)
     {
-      icache[idx].tag = -1;
-      tracer.trace(paddr, 1, false, true);
+      record(entry->paddr, entry->data.insn.length(), false, true);
+      last_fetch_block = fetch_block_mask ? block : -1;
     }
-    return &icache[idx];
   }
 
+  // hand the accesses recorded so far to the tracers
+  void flush_trace();
+  // before running on: if another hart's accesses were traced since this
+  // one's, they may have evicted the block this one last fetched from a
+  // cache they share, so its next fetch is recorded in any case
+  void resume_trace();
+  // stop handing accesses to the tracers for a while, or go on again
+  void pause_trace(bool value);
+
   inline insn_fetch_t load_insn(reg_t addr)
   {
     return access_icache(addr)->data;
@@ -160,30 +204,153 @@ public:
 
   void set_processor(processor_t* p) {
     proc = p;
-#ifdef RISCV_ENABLE_DBG_TRACE
     if (p)
       insn_tracer = p->get_dbg_tracer();
-#endif
     flush_tlb();
   }
 
 
   void flush_tlb();
   void flush_icache();
+  // what fence.i does: forget the instructions decoded so far, including
+  // those shared with other harts
+  void fence_i();
+  // forget which pages may be stored to without a refill
+  void flush_store_tlb();
+
+  // TLB, icache and basic block entries filled in supervisor mode are kept
+  // apart from user-mode ones, as they may have been granted other
+  // permissions, so traps and sret need not flush them
+  void set_supervisor(bool value)
+  {
+    tlb_priv = value ? reg_t(1) << 63 : 0;
+    icache = icaches[value];
+    bb_cache = bb_caches[value];
+  }
+
+  // whether other harts may access memory while this one runs. only then
+  // do AMOs and SCs have to be host atomics.
+  void set_concurrent(bool value) { concurrent = value; }
 
+  // tracers see loads, stores and fetches in batches, as flush_trace or
+  // a full buffer hands them over, but in the order they happened
   void register_memtracer(memtracer_t*);
 
+  // share decoded instructions with the other harts through cache, or
+  // stop with NULL
+  void set_decode_cache(decode_cache_t* cache);
+
 private:
+  target_mem_t* target_mem;
   char* mem;
   size_t memsz;
   processor_t* proc;
   memtracer_list_t tracer;
-#ifdef RISCV_ENABLE_DBG_TRACE
+  bool tracing; // whether tracer has any, and is not paused
+  // accesses the tracers have yet to see, oldest first
+  static const size_t TRACE_EVENTS = 4096;
+  mem_event_t trace_events[TRACE_EVENTS];
+  size_t trace_used;
+  reg_t fetch_block_mask; // the tracers' fetch block, or 0 for none
+  reg_t last_fetch_block;
+
+  void record(reg_t paddr, size_t bytes, bool store, bool fetch)
+  {
+    trace_events[trace_used++] = (mem_event_t){paddr, uint32_t(bytes), store, fetch};
+    if (unlikely(trace_used == TRACE_EVENTS))
+      flush_trace();
+  }
+
+  void trace_access(void* paddr, reg_t bytes, bool store) __attribute__((always_inline))
+  {
+    if (unlikely(tracing))
+      record((char*)paddr - mem, bytes, store, false);
+  }
+
   debug_tracer_t* insn_tracer;
-#endif
+  bool concurrent;
+  // whether an access that faults posts its trap to the processor, rather
+  // than throwing it (see processor_t::post_fault). the processor turns
+  // this on for its own loops only, while it runs without hooks.
+  bool post_faults;
+  decode_cache_t* decode_cache;
+
+  template <class T, class op> T atomic_update(T* paddr, op f)
+  {
+    T old = *paddr;
+    if (!concurrent)
+      *paddr = f(old);
+    else
+      while (!__atomic_compare_exchange_n(paddr, &old, f(old), true,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return old;
+  }
+
+  template <class T> bool atomic_replace(T* paddr, T expected, T val)
+  {
+    if (!concurrent)
+    {
+      *paddr = val;
+      return true;
+    }
+    return __atomic_compare_exchange_n(paddr, &expected, val, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+  }
+
+  // or'ed into TLB tags in supervisor mode; no vpn reaches bit 63. a pc
+  // has no such spare bit, so the icache and basic block cache have a
+  // bank per mode instead.
+  reg_t tlb_priv;
 
   // implement an instruction cache for simulator performance
-  icache_entry_t icache[ICACHE_ENTRIES];
+  icache_entry_t icaches[2][ICACHE_ENTRIES];
+  icache_entry_t* icache; // the current mode's bank
+
+  // basic blocks decoded ahead of execution, indexed like the icache
+  bb_cache_entry_t bb_caches[2][BB_CACHE_ENTRIES];
+  bb_cache_entry_t* bb_cache;
+  bb_cache_entry_t* refill_bb_cache(reg_t addr);
+
+  // fetch and decode the instruction at addr, bypassing the icache
+  insn_fetch_t fetch_insn(reg_t addr, char** iaddr_out) __attribute__((always_inline))
+  {
+    bool rvc = false; // set this dynamically once RVC is re-implemented
+    char* iaddr = (char*)translate(addr, rvc ? 2 : 4, false, true);
+    *iaddr_out = iaddr;
+    if (unlikely((void*)iaddr == fault_scratch))
+      return (insn_fetch_t){&faulted_fetch, 0};
+    if (unlikely(decode_cache != NULL) &&
+        (addr & (PGSIZE-1)) <= PGSIZE - sizeof(insn_bits_t))
+      return fetch_shared(iaddr);
+
+    insn_bits_t insn = *(uint16_t*)iaddr;
+
+    if (unlikely(insn_length(insn) == 2)) {
+      insn = (int16_t)insn;
+    } else if (likely(insn_length(insn) == 4)) {
+      if (likely((addr & (PGSIZE-1)) < PGSIZE-2))
+        insn |= (insn_bits_t)*(int16_t*)(iaddr + 2) << 16;
+      else
+        insn |= (insn_bits_t)*(int16_t*)translate(addr + 2, 2, false, true) << 16;
+    } else if (insn_length(insn) == 6) {
+      insn |= (insn_bits_t)*(int16_t*)translate(addr + 4, 2, false, true) << 32;
+      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 2, false, true) << 16;
+    } else {
+      static_assert(sizeof(insn_bits_t) == 8, "insn_bits_t must be uint64_t");
+      insn |= (insn_bits_t)*(int16_t*)translate(addr + 6, 2, false, true) << 48;
+      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 4, 2, false, true) << 32;
+      insn |= (insn_bits_t)*(uint16_t*)translate(addr + 2, 2, false, true) << 16;
+    }
+
+    // the rest of an instruction that runs onto the next page may fault
+    if (unlikely(post_faults) && proc->insn_faulted())
+      return (insn_fetch_t){&faulted_fetch, 0};
+    return (insn_fetch_t){proc->decode_insn(insn), insn};
+  }
+
+  // fetch_insn through the shared decode cache, for an instruction that
+  // lies within one page
+  insn_fetch_t fetch_shared(char* iaddr);
 
   // implement a TLB for simulator performance
   static const reg_t TLB_ENTRIES = 256;
@@ -195,6 +362,11 @@ private:
   // finish translation on a TLB miss and upate the TLB
   void* refill_tlb(reg_t addr, reg_t bytes, bool store, bool fetch);
 
+  // throw the trap for a fault of the given cause, or post it and return
+  // somewhere harmless for the faulting access to go on to
+  void* fault(reg_t cause, reg_t addr) __attribute__((cold));
+  reg_t fault_scratch[2];
+
   // perform a page table walk for a given virtual address
   pte_t walk(reg_t addr);
 
@@ -203,15 +375,14 @@ private:
     __attribute__((always_inline))
   {
     reg_t idx = (addr >> PGSHIFT) % TLB_ENTRIES;
-    reg_t expected_tag = addr >> PGSHIFT;
+    reg_t expected_tag = (addr >> PGSHIFT) | tlb_priv;
     reg_t* tags = fetch ? tlb_insn_tag : store ? tlb_store_tag :tlb_load_tag;
     reg_t tag = tags[idx];
     void* data = tlb_data[idx] + addr;
 
     if (unlikely(addr & (bytes-1)))
-      store ? throw trap_store_address_misaligned(addr) :
-      fetch ? throw trap_instruction_address_misaligned(addr) :
-      throw trap_load_address_misaligned(addr);
+      return fault(store ? CAUSE_MISALIGNED_STORE :
+                   fetch ? CAUSE_MISALIGNED_FETCH : CAUSE_MISALIGNED_LOAD, addr);
 
     if (likely(tag == expected_tag))
       return data;
@@ -220,6 +391,106 @@ private:
   }
 
   friend class processor_t;
+  friend class traced_mmu_t;
+};
+
+// what MMU names in traced handlers: the same loads and stores as mmu_t,
+// each reported to the debug tracer before translation and after the access
+class traced_mmu_t
+{
+public:
+  traced_mmu_t(mmu_t* _mmu) : mmu(_mmu) {}
+
+  #define traced_load_func(type) \
+    type##_t load_##type(reg_t addr) { \
+      mmu->insn_tracer->trace_before_dc_translate(addr, sizeof(type##_t), false); \
+      void* paddr = mmu->translate(addr, sizeof(type##_t), false, false); \
+      mmu->trace_access(paddr, sizeof(type##_t), false); \
+      auto load_val = *(type##_t*)paddr; \
+      mmu->insn_tracer->trace_after_dc_access(addr, ((uintptr_t)paddr - (uintptr_t)mmu->mem), load_val, sizeof(type##_t), false); \
+      return load_val; \
+    }
+
+  #define traced_store_func(type) \
+    void store_##type(reg_t addr, type##_t val) { \
+      mmu->insn_tracer->trace_before_dc_translate(addr, sizeof(type##_t), true); \
+      void* paddr = mmu->translate(addr, sizeof(type##_t), true, false); \
+      mmu->trace_access(paddr, sizeof(type##_t), true); \
+      *(type##_t*)paddr = val; \
+      mmu->insn_tracer->trace_after_dc_access(addr, ((uintptr_t)paddr - (uintptr_t)mmu->mem), val, sizeof(type##_t), true); \
+    }
+
+  traced_load_func(uint8)
+  traced_load_func(uint16)
+  traced_load_func(uint32)
+  traced_load_func(uint64)
+
+  traced_load_func(int8)
+  traced_load_func(int16)
+  traced_load_func(int32)
+  traced_load_func(int64)
+
+  traced_store_func(uint8)
+  traced_store_func(uint16)
+  traced_store_func(uint32)
+  traced_store_func(uint64)
+
+  // reported as the store, which is the access the tracer keeps
+  #define traced_amo_func(type) \
+    template <class op> type##_t amo_##type(reg_t addr, op f) { \
+      type##_t old = load_##type(addr); \
+      mmu->insn_tracer->trace_before_dc_translate(addr, sizeof(type##_t), true); \
+      void* paddr = mmu->translate(addr, sizeof(type##_t), true, false); \
+      mmu->trace_access(paddr, sizeof(type##_t), true); \
+      old = mmu->atomic_update((type##_t*)paddr, f); \
+      mmu->insn_tracer->trace_after_dc_access(addr, ((uintptr_t)paddr - (uintptr_t)mmu->mem), f(old), sizeof(type##_t), true); \
+      return old; \
+    }
+
+  #define traced_store_conditional_func(type) \
+    bool store_conditional_##type(reg_t addr, type##_t expected, type##_t val) { \
+      mmu->insn_tracer->trace_before_dc_translate(addr, sizeof(type##_t), true); \
+      void* paddr = mmu->translate(addr, sizeof(type##_t), true, false); \
+      mmu->trace_access(paddr, sizeof(type##_t), true); \
+      bool stored = mmu->atomic_replace((type##_t*)paddr, expected, val); \
+      mmu->insn_tracer->trace_after_dc_access(addr, ((uintptr_t)paddr - (uintptr_t)mmu->mem), val, sizeof(type##_t), true); \
+      return stored; \
+    }
+
+  traced_amo_func(uint32)
+  traced_amo_func(uint64)
+  traced_store_conditional_func(uint32)
+  traced_store_conditional_func(uint64)
+
+  void fence_i() { mmu->fence_i(); }
+
+private:
+  mmu_t* mmu;
+};
+
+// the instrumentation policy of the traced handlers and of the step loop
+// that runs the per-instruction hooks (see fast_policy_t in processor.h)
+struct traced_policy_t
+{
+  static const bool instrumented = true;
+
+  static reg_t read_xpr(processor_t* p, size_t rn, operand_t operand)
+  {
+    return p->rd_xpr(rn, operand);
+  }
+  static void write_xpr(processor_t* p, size_t rn, reg_t val)
+  {
+    p->wr_xpr(rn, val);
+  }
+  static freg_t read_fpr(processor_t* p, size_t rn, operand_t operand)
+  {
+    return p->rd_fpr(rn, operand);
+  }
+  static void write_fpr(processor_t* p, size_t rn, freg_t val)
+  {
+    p->wr_fpr(rn, val);
+  }
+  static traced_mmu_t mmu(processor_t* p) { return traced_mmu_t(p->get_mmu()); }
 };
 
 #endif
@@ -0,0 +1,111 @@
+// See LICENSE for license details.
+
+#include "page_store.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccd;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53;
+  k ^= k >> 33;
+  return k;
+}
+
+page_store_t::hash_t page_store_t::hash(const char* data, size_t len)
+{
+  const uint64_t c1 = 0x87c37b91114253d5;
+  const uint64_t c2 = 0x4cf5ad432745937f;
+  uint64_t h1 = 0, h2 = 0;
+
+  size_t nblocks = len / 16;
+  for (size_t i = 0; i < nblocks; i++)
+  {
+    uint64_t k1, k2;
+    memcpy(&k1, data + i*16, 8);
+    memcpy(&k2, data + i*16 + 8, 8);
+
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+  }
+
+  const unsigned char* tail = (const unsigned char*)data + nblocks*16;
+  size_t rem = len & 15;
+  uint64_t k1 = 0, k2 = 0;
+  for (size_t i = rem; i > 8; i--)
+    k2 ^= uint64_t(tail[i-1]) << ((i-9)*8);
+  for (size_t i = rem < 8 ? rem : 8; i > 0; i--)
+    k1 ^= uint64_t(tail[i-1]) << ((i-1)*8);
+  if (rem > 8)
+  {
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+  }
+  if (rem > 0)
+  {
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= len; h2 ^= len;
+  h1 += h2; h2 += h1;
+  h1 = fmix64(h1); h2 = fmix64(h2);
+  h1 += h2; h2 += h1;
+  return hash_t{h1, h2};
+}
+
+// pages are spread over 256 subdirectories by the first byte of the hash
+std::string page_store_t::page_path(const hash_t& h, bool make_dir)
+{
+  char name[40];
+  snprintf(name, sizeof(name), "%016llx%016llx",
+           (unsigned long long)h.hi, (unsigned long long)h.lo);
+  std::string sub = dir + "/" + std::string(name, 2);
+  if (make_dir)
+  {
+    mkdir(dir.c_str(), 0777);
+    mkdir(sub.c_str(), 0777);
+  }
+  return sub + "/" + name;
+}
+
+bool page_store_t::put(const hash_t& h, const char* data, size_t len)
+{
+  std::string path = page_path(h, false);
+  if (access(path.c_str(), F_OK) == 0)
+    return true;
+
+  // other simulators may be adding the same page; whoever renames last wins
+  // with the same contents
+  path = page_path(h, true);
+  std::string tmp = path + "." + std::to_string(getpid());
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return false;
+  bool ok = write(fd, data, len) == ssize_t(len);
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+  if (!ok)
+    unlink(tmp.c_str());
+  return ok;
+}
+
+bool page_store_t::get(const hash_t& h, char* data, size_t len)
+{
+  int fd = open(page_path(h, false).c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  bool ok = read(fd, data, len) == ssize_t(len);
+  close(fd);
+  return ok;
+}
@@ -0,0 +1,42 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_PAGE_STORE_H
+#define _RISCV_PAGE_STORE_H
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+// a directory of memory pages, each in a file named after the hash of its
+// contents. checkpoints that keep their memory here only list which page
+// goes where, so all the checkpoints of a program, or of several runs of
+// it, share one copy of each distinct page.
+class page_store_t
+{
+public:
+  struct hash_t
+  {
+    uint64_t lo, hi;
+  };
+
+  explicit page_store_t(const std::string& dir) : dir(dir) {}
+  const std::string& path() { return dir; }
+
+  // MurmurHash3 (x64, 128 bits) of len bytes at data
+  static hash_t hash(const char* data, size_t len);
+
+  // add a page unless the store has it already
+  bool put(const hash_t& h, const char* data, size_t len);
+
+  // read back a page of len bytes
+  bool get(const hash_t& h, char* data, size_t len);
+
+  // the file that holds a page
+  std::string file(const hash_t& h) { return page_path(h, false); }
+
+private:
+  std::string dir;
+  std::string page_path(const hash_t& h, bool make_dir);
+};
+
+#endif
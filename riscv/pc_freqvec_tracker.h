@@ -1,7 +1,7 @@
 #include <cinttypes>
 #include <string>
 #include <cstring>
-#include "gzstream.h"
+#include "pgzstream.h"
 #include "bbtracker.h"
 
 #define __FREQ_VEC_ELEMENT_T_concat(size) uint##size##_t
@@ -31,7 +31,7 @@ class pc_freqvec_tracker_t {
 private:
   FREQ_VEC_ELEMENT_T freqvec[FREQ_VEC_SIZE] = {0};
   FREQ_VEC_ELEMENT_T insn_in_vec = 0;
-  ogzstream freqvec_out;
+  opgzstream freqvec_out;
 
   void reset_vec() {
     insn_in_vec = 0;
@@ -0,0 +1,341 @@
+// See LICENSE for license details.
+
+#include "pgzstream.h"
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+// gzip member header: magic, CM = deflate, FLG = FEXTRA, MTIME, XFL, OS,
+// then XLEN and the one 'S','C' subfield of two 32-bit sizes
+static const size_t HEADER_SIZE = 10 + 2 + 4 + 8;
+static const size_t TRAILER_SIZE = 8;
+static const unsigned char FEXTRA = 4;
+
+static void put16(unsigned char* p, uint32_t x)
+{
+  p[0] = x;
+  p[1] = x >> 8;
+}
+
+static void put32(unsigned char* p, uint32_t x)
+{
+  put16(p, x);
+  put16(p + 2, x >> 16);
+}
+
+static uint32_t get16(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char* p)
+{
+  return get16(p) | (get16(p + 2) << 16);
+}
+
+// read the fixed part of a member header and its extra field from f and
+// find the sizes this stream stores there. false at end of file, or if the
+// member was not written by pgzstreambuf.
+static bool read_member_header(FILE* f, std::string& header,
+                               uint32_t& csize, uint32_t& usize)
+{
+  unsigned char fixed[12];
+  if (fread(fixed, 1, sizeof(fixed), f) != sizeof(fixed) ||
+      fixed[0] != 0x1f || fixed[1] != 0x8b || fixed[2] != Z_DEFLATED ||
+      fixed[3] != FEXTRA)
+    return false;
+
+  size_t xlen = get16(fixed + 10);
+  header.assign((char*)fixed, sizeof(fixed));
+  header.resize(sizeof(fixed) + xlen);
+  if (fread(&header[sizeof(fixed)], 1, xlen, f) != xlen)
+    return false;
+
+  const unsigned char* x = (const unsigned char*)header.data() + sizeof(fixed);
+  for (size_t i = 0; i + 4 <= xlen; i += 4 + get16(x + i + 2))
+  {
+    if (x[i] == 'S' && x[i+1] == 'C' && get16(x + i + 2) == 8 && i + 12 <= xlen)
+    {
+      csize = get32(x + i + 4);
+      usize = get32(x + i + 8);
+      return csize >= header.size() + TRAILER_SIZE;
+    }
+  }
+  return false;
+}
+
+pgzstreambuf::pgzstreambuf()
+  : file(NULL), gzfile(NULL), output(false), at_end(false),
+    max_pending(std::max(2u, std::thread::hardware_concurrency()))
+{
+  setp(NULL, NULL);
+  setg(NULL, NULL, NULL);
+}
+
+pgzstreambuf* pgzstreambuf::open(const char* name, int open_mode)
+{
+  if (is_open())
+    return NULL;
+  // like gzstreambuf, one direction at a time
+  if ((open_mode & std::ios::in) && (open_mode & std::ios::out))
+    return NULL;
+  if (!(open_mode & (std::ios::in | std::ios::out)))
+    return NULL;
+
+  output = open_mode & std::ios::out;
+  at_end = false;
+  if (!(file = fopen(name, output ? "wb" : "rb")))
+    return NULL;
+
+  if (output)
+  {
+    buffer.resize(CHUNK_SIZE);
+    setp(&buffer[0], &buffer[0] + buffer.size());
+    return this;
+  }
+
+  // files from elsewhere, e.g. older checkpoints, are read serially
+  std::string header;
+  uint32_t csize, usize;
+  bool empty = fgetc(file) == EOF;
+  rewind(file);
+  if (!empty && !read_member_header(file, header, csize, usize))
+  {
+    fclose(file);
+    file = NULL;
+    if (!(gzfile = gzopen(name, "rb")))
+      return NULL;
+  }
+  else
+    rewind(file);
+  return this;
+}
+
+pgzstreambuf* pgzstreambuf::close()
+{
+  if (!is_open())
+    return NULL;
+
+  // the chunk being filled is the last member, however short
+  bool ok = !output ||
+            (submit() && write_pending(0) && fflush(file) == 0);
+  pending.clear();
+  if (file && fclose(file) != 0)
+    ok = false;
+  if (gzfile && gzclose(gzfile) != Z_OK)
+    ok = false;
+  file = NULL;
+  gzfile = NULL;
+  std::string().swap(buffer);
+  setp(NULL, NULL);
+  setg(NULL, NULL, NULL);
+  return ok ? this : NULL;
+}
+
+std::string pgzstreambuf::deflate_member(std::string data)
+{
+  z_stream zs = z_stream();
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::runtime_error("deflateInit2 failed");
+
+  std::string member(HEADER_SIZE + deflateBound(&zs, data.size()) + TRAILER_SIZE, 0);
+  zs.next_in = (Bytef*)&data[0];
+  zs.avail_in = data.size();
+  zs.next_out = (Bytef*)&member[HEADER_SIZE];
+  zs.avail_out = member.size() - HEADER_SIZE - TRAILER_SIZE;
+  int ret = deflate(&zs, Z_FINISH);
+  size_t clen = zs.total_out;
+  deflateEnd(&zs);
+  if (ret != Z_STREAM_END)
+    throw std::runtime_error("deflate failed");
+  member.resize(HEADER_SIZE + clen + TRAILER_SIZE);
+
+  unsigned char* h = (unsigned char*)&member[0];
+  h[0] = 0x1f;
+  h[1] = 0x8b;
+  h[2] = Z_DEFLATED;
+  h[3] = FEXTRA;
+  put32(h + 4, 0);
+  h[8] = 0;
+  h[9] = 255;
+  put16(h + 10, 4 + 8);
+  h[12] = 'S';
+  h[13] = 'C';
+  put16(h + 14, 8);
+  put32(h + 16, member.size());
+  put32(h + 20, data.size());
+
+  unsigned char* t = h + HEADER_SIZE + clen;
+  put32(t, crc32(0, (const Bytef*)data.data(), data.size()));
+  put32(t + 4, data.size());
+  return member;
+}
+
+std::string pgzstreambuf::inflate_member(std::string member, size_t usize)
+{
+  const unsigned char* m = (const unsigned char*)member.data();
+  size_t start = 12 + get16(m + 10);
+  std::string data(usize, 0);
+
+  z_stream zs = z_stream();
+  if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+    throw std::runtime_error("inflateInit2 failed");
+  zs.next_in = (Bytef*)&member[start];
+  zs.avail_in = member.size() - start - TRAILER_SIZE;
+  zs.next_out = (Bytef*)&data[0];
+  zs.avail_out = usize;
+  int ret = inflate(&zs, Z_FINISH);
+  size_t len = zs.total_out;
+  inflateEnd(&zs);
+
+  const unsigned char* t = m + member.size() - TRAILER_SIZE;
+  if (ret != Z_STREAM_END || len != usize || get32(t + 4) != usize ||
+      get32(t) != crc32(0, (const Bytef*)data.data(), usize))
+    throw std::runtime_error("corrupt gzip member");
+  return data;
+}
+
+bool pgzstreambuf::submit()
+{
+  size_t n = pptr() - pbase();
+  if (n == 0)
+    return true;
+
+  pending.push_back(std::async(std::launch::async, deflate_member,
+                               std::string(pbase(), n)));
+  setp(&buffer[0], &buffer[0] + buffer.size());
+  return write_pending(max_pending - 1);
+}
+
+// write finished members in order, waiting for the oldest ones until no
+// more than keep are outstanding
+bool pgzstreambuf::write_pending(size_t keep)
+{
+  while (!pending.empty() &&
+         (pending.size() > keep ||
+          pending.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+  {
+    std::string member;
+    try
+    {
+      member = pending.front().get();
+    }
+    catch (std::exception&)
+    {
+      pending.pop_front();
+      return false;
+    }
+    pending.pop_front();
+    if (fwrite(member.data(), 1, member.size(), file) != member.size())
+      return false;
+  }
+  return true;
+}
+
+// hand members to the workers until max_pending are being inflated
+void pgzstreambuf::read_ahead()
+{
+  while (!at_end && pending.size() < max_pending)
+  {
+    std::string member;
+    uint32_t csize, usize;
+    if (!read_member_header(file, member, csize, usize))
+    {
+      at_end = true;
+      if (!feof(file) || !member.empty())
+      {
+        std::promise<std::string> bad;
+        bad.set_exception(std::make_exception_ptr(
+          std::runtime_error("corrupt gzip member header")));
+        pending.push_back(bad.get_future());
+      }
+      break;
+    }
+
+    size_t hlen = member.size();
+    member.resize(csize);
+    if (fread(&member[hlen], 1, csize - hlen, file) != csize - hlen)
+    {
+      at_end = true;
+      std::promise<std::string> bad;
+      bad.set_exception(std::make_exception_ptr(
+        std::runtime_error("truncated gzip member")));
+      pending.push_back(bad.get_future());
+      break;
+    }
+
+    pending.push_back(std::async(std::launch::async, inflate_member,
+                                 std::move(member), usize));
+  }
+}
+
+int pgzstreambuf::overflow(int c)
+{
+  if (!output || !file || !submit())
+    return EOF;
+  if (c != EOF)
+  {
+    *pptr() = c;
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+int pgzstreambuf::underflow()
+{
+  if (gptr() && gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+  if (output)
+    return EOF;
+
+  if (gzfile)
+  {
+    buffer.resize(1 << 16);
+    int n = gzread(gzfile, &buffer[0], buffer.size());
+    if (n <= 0)
+      return EOF;
+    setg(&buffer[0], &buffer[0], &buffer[0] + n);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  if (!file)
+    return EOF;
+  do
+  {
+    read_ahead();
+    if (pending.empty())
+      return EOF;
+    // rethrows a corrupt member; the istream turns that into badbit
+    buffer = pending.front().get();
+    pending.pop_front();
+  } while (buffer.empty());
+
+  read_ahead();
+  setg(&buffer[0], &buffer[0], &buffer[0] + buffer.size());
+  return traits_type::to_int_type(*gptr());
+}
+
+int pgzstreambuf::sync()
+{
+  if (!output || !file)
+    return 0;
+  // only what the workers are done with: cutting a member at every flush
+  // (say each std::endl) would make them tiny, and leave the caller
+  // waiting for them to deflate
+  if (!write_pending(max_pending - 1) || fflush(file) != 0)
+    return -1;
+  return 0;
+}
+
+void pgzstreambase::open(const char* name, int open_mode)
+{
+  if (!buf.open(name, open_mode))
+    clear(rdstate() | std::ios::badbit);
+}
+
+void pgzstreambase::close()
+{
+  if (buf.is_open() && !buf.close())
+    clear(rdstate() | std::ios::badbit);
+}
@@ -0,0 +1,94 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_PGZSTREAM_H
+#define _RISCV_PGZSTREAM_H
+
+#include <deque>
+#include <future>
+#include <iostream>
+#include <string>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+// gzip streams that compress and decompress on a pool of threads.
+//
+// Output is cut into chunks of CHUNK_SIZE bytes, and each chunk becomes an
+// independent gzip member, so the file is still read by zcat, gzread and
+// igzstream. Each member's header carries an extra field (subfield 'S','C')
+// holding the member's compressed and uncompressed sizes. That chain of
+// sizes is the block index: a reader can step from member to member without
+// inflating anything, and hand several members to workers at once.
+//
+// Input recognizes that layout and inflates ahead on the workers; any other
+// gzip file is read serially through zlib instead.
+class pgzstreambuf : public std::streambuf
+{
+public:
+  static const size_t CHUNK_SIZE = 4 << 20;
+
+  pgzstreambuf();
+  ~pgzstreambuf() { close(); }
+
+  bool is_open() { return file != NULL || gzfile != NULL; }
+  pgzstreambuf* open(const char* name, int open_mode);
+  pgzstreambuf* close();
+
+protected:
+  int overflow(int c = EOF);
+  int underflow();
+  int sync();
+
+private:
+  FILE* file;
+  gzFile gzfile;
+  bool output;
+  bool at_end;
+  size_t max_pending;
+  std::string buffer;
+  // compressed members to write, or inflated chunks to read, in file order
+  std::deque<std::future<std::string>> pending;
+
+  bool submit();
+  bool write_pending(size_t keep);
+  void read_ahead();
+
+  static std::string deflate_member(std::string data);
+  static std::string inflate_member(std::string member, size_t usize);
+};
+
+class pgzstreambase : virtual public std::ios
+{
+public:
+  pgzstreambase() { init(&buf); }
+  void open(const char* name, int open_mode);
+  void close();
+  pgzstreambuf* rdbuf() { return &buf; }
+
+protected:
+  pgzstreambuf buf;
+};
+
+class ipgzstream : public pgzstreambase, public std::istream
+{
+public:
+  ipgzstream() : std::istream(&buf) {}
+  pgzstreambuf* rdbuf() { return pgzstreambase::rdbuf(); }
+  void open(const char* name, int open_mode = std::ios::in)
+  {
+    pgzstreambase::open(name, open_mode);
+  }
+};
+
+class opgzstream : public pgzstreambase, public std::ostream
+{
+public:
+  opgzstream() : std::ostream(&buf) {}
+  pgzstreambuf* rdbuf() { return pgzstreambase::rdbuf(); }
+  void open(const char* name, int open_mode = std::ios::out)
+  {
+    pgzstreambase::open(name, open_mode);
+  }
+};
+
+#endif
@@ -10,6 +10,8 @@
 #include "htif.h"
 #include "disasm.h"
 #include "debug_tracer.h"
+#include "jit.h"
+#include "decoder.h"
 #include <cinttypes>
 #include <cmath>
 #include <cstdlib>
@@ -26,32 +28,30 @@
 extern bool logging_on;
 
 processor_t::processor_t(sim_t* _sim, mmu_t* _mmu, uint32_t _id)
-  : sim(_sim), mmu(_mmu), ext(NULL), disassembler(new disassembler_t),
-    id(_id), run(false), debug(false), serialized(false)
+  : sim(_sim), mmu(_mmu), ext(NULL), decoder(_sim->get_decoder(NULL)),
+    id(_id), run(false), debug(false), histogram_enabled(false),
+    commit_log_enabled(false), traced_handlers(false), serialized(false),
+    dispatch(DISPATCH_LOOP), jit(NULL), pending_trap(NULL),
+    fetch_misaligned_trap(0), fetch_fault_trap(0), load_misaligned_trap(0),
+    load_fault_trap(0), store_misaligned_trap(0), store_fault_trap(0),
+    block_end(NULL), threaded_block(NULL), threaded_fault_label(NULL),
+    live_instret(0),
+    concurrent(false), ipi_pending(false)
 {
-#ifdef RISCV_ENABLE_DBG_TRACE
   dbg_tracer = new debug_tracer_t(this);
-#endif
+  log_reg_write.addr = 0;
 
   reset(true);
   mmu->set_processor(this);
 
-  #define DECLARE_INSN(name, match, mask) REGISTER_INSN(this, name, match, mask)
-  #include "encoding.h"
-  #undef DECLARE_INSN
-  build_opcode_map();
-
-#ifdef RISCV_ENABLE_SIMPOINT
   num_bb_inst = 0;
   simpoint_enabled = false;
   bbt = new bb_tracker_t();
   pc_freqvec_tracker = new pc_freqvec_tracker_t();
-#endif
 }
 
 processor_t::~processor_t()
 {
-#ifdef RISCV_ENABLE_HISTOGRAM
   if (histogram_enabled)
   {
     fprintf(stderr, "PC Histogram size:%lu\n", pc_histogram.size());
@@ -59,18 +59,12 @@ processor_t::~processor_t()
       fprintf(stderr, "%0lx %lu\n", (iterator->first << 2), iterator->second);
     }
   }
-#endif
 
-#ifdef RISCV_ENABLE_SIMPOINT
   delete bbt;
   delete pc_freqvec_tracker;
-#endif
-
-#ifdef RISCV_ENABLE_DBG_TRACE
   delete dbg_tracer;
-#endif
 
-  delete disassembler;
+  delete jit;
 }
 
 void state_t::reset()
@@ -115,7 +109,31 @@ void processor_t::set_histogram(bool value)
   histogram_enabled = value;
 }
 
-#ifdef RISCV_ENABLE_SIMPOINT
+void processor_t::set_commit_log(bool value)
+{
+  commit_log_enabled = value;
+  update_handlers();
+}
+
+void processor_t::update_handlers()
+{
+  // decoded handlers are cached in the icache and the basic block cache,
+  // so those have to be refilled from the other set
+  bool traced = dbg_tracer->enabled() || commit_log_enabled;
+  if (traced != traced_handlers)
+  {
+    traced_handlers = traced;
+    mmu->flush_icache();
+  }
+}
+
+void processor_t::set_dispatch(dispatch_t value)
+{
+  dispatch = value;
+  if (dispatch == DISPATCH_JIT && !jit)
+    jit = new jit_t(mmu);
+}
+
 void processor_t::set_simpoint(bool enable, size_t interval)
 {
   simpoint_enabled = enable;
@@ -134,9 +152,6 @@ void processor_t::set_simpoint(bool enable, size_t interval)
   }
 }
 
-#endif
-
-#ifdef RISCV_ENABLE_DBG_TRACE
 void processor_t::enable_trace(size_t n)
 {
   if (!dbg_tracer->enabled()) {
@@ -152,12 +167,27 @@ void processor_t::enable_trace(size_t n)
       trace_outputter = new trace_output_direct_t(trace_file_name);
     }
     dbg_tracer->enable_trace(trace_outputter);
+    update_handlers();
   }
 }
 
+void processor_t::close_outputs()
+{
+  delete bbt;
+  delete pc_freqvec_tracker;
+  delete dbg_tracer;
+  bbt = new bb_tracker_t();
+  pc_freqvec_tracker = new pc_freqvec_tracker_t();
+  dbg_tracer = new debug_tracer_t(this);
+  mmu->set_processor(this); // which keeps the tracer too
+  simpoint_enabled = false;
+  update_handlers();
+}
+
 void processor_t::enable_insn_info_collection() {
   if (!dbg_tracer->enabled()) {
     dbg_tracer->enable_trace(new trace_output_null_t());
+    update_handlers();
   }
 }
 
@@ -171,6 +201,8 @@ reg_t processor_t::rd_xpr(size_t rn, operand_t operand)
 void processor_t::wr_xpr(size_t rn, reg_t val)
 {
   state.XPR.write(rn, val);
+  if (commit_log_enabled)
+    log_reg_write = (commit_log_reg_t){rn << 1, val};
   dbg_tracer->trace_after_xpr_access(rn, val, RDST_OPERAND);
 }
 
@@ -184,9 +216,10 @@ freg_t processor_t::rd_fpr(size_t rn, operand_t operand)
 void processor_t::wr_fpr(size_t rn, freg_t val)
 {
   state.FPR.write(rn, val);
+  if (commit_log_enabled)
+    log_reg_write = (commit_log_reg_t){(rn << 1) | 1, val};
   dbg_tracer->trace_after_fpr_access(rn, val, RDST_OPERAND);
 }
-#endif
 
 void processor_t::reset(bool value)
 {
@@ -197,6 +230,7 @@ void processor_t::reset(bool value)
   run = !value;
 
   state.reset(); // reset the core
+  mmu->flush_tlb();
   set_pcr(CSR_STATUS, state.sr);
 
   if (ext)
@@ -224,50 +258,52 @@ void processor_t::take_interrupt()
       throw trap_t((1ULL << ((state.sr & SR_S64) ? 63 : 31)) + i);
 }
 
-static void commit_log(state_t* state, reg_t pc, insn_t insn)
+void processor_t::commit_log(reg_t pc, insn_t insn)
 {
-#ifdef RISCV_ENABLE_COMMITLOG
-  if (state->sr & SR_EI) {
+  if (state.sr & SR_EI) {
     uint64_t mask = (insn.length() == 8 ? uint64_t(0) : (uint64_t(1) << (insn.length() * 8))) - 1;
-    if (state->log_reg_write.addr) {
+    if (log_reg_write.addr) {
       fprintf(stderr, "0x%016" PRIx64 " (0x%08" PRIx64 ") %c%2" PRIu64 " 0x%016" PRIx64 "\n",
               pc,
               insn.bits() & mask,
-              state->log_reg_write.addr & 1 ? 'f' : 'x',
-              state->log_reg_write.addr >> 1,
-              state->log_reg_write.data);
+              log_reg_write.addr & 1 ? 'f' : 'x',
+              log_reg_write.addr >> 1,
+              log_reg_write.data);
     } else {
       fprintf(stderr, "0x%016" PRIx64 " (0x%08" PRIx64 ")\n", pc, insn.bits() & mask);
     }
   }
-  state->log_reg_write.addr = 0;
-#endif
+  log_reg_write.addr = 0;
 }
 
 inline void processor_t::update_histogram(size_t pc)
 {
-#ifdef RISCV_ENABLE_HISTOGRAM
   size_t idx = pc >> 2;
   pc_histogram[idx]++;
-#endif
 }
 
-static reg_t execute_insn(processor_t* p, reg_t pc, insn_fetch_t fetch)
+// with fast_policy_t this is just the handler call; the hooks are only
+// compiled into the instrumented step loop, and each checks whether it is on
+template <class policy>
+static inline reg_t execute_insn(processor_t* p, reg_t pc, insn_fetch_t fetch)
 {
+  if (!policy::instrumented)
+    return fetch.func(p, fetch.insn, pc);
 
-#ifdef RISCV_ENABLE_DBG_TRACE
-  p->get_dbg_tracer()->trace_before_insn_execute(pc, fetch.insn);
-#endif
+  debug_tracer_t* dbg_tracer = p->get_dbg_tracer();
+  dbg_tracer->trace_before_insn_execute(pc, fetch.insn);
 
   reg_t npc = fetch.func(p, fetch.insn, pc);
-  commit_log(p->get_state(), pc, fetch.insn);
-  p->update_histogram(pc);
+  // a posted trap is reported when it is delivered, as a thrown one is
+  if (unlikely(p->get_pending_trap() != NULL))
+    return npc;
+  if (unlikely(p->get_commit_log()))
+    p->commit_log(pc, fetch.insn);
+  if (unlikely(p->get_histogram()))
+    p->update_histogram(pc);
 
-#ifdef RISCV_ENABLE_DBG_TRACE
-  p->get_dbg_tracer()->trace_after_insn_execute(pc);
-#endif
+  dbg_tracer->trace_after_insn_execute(pc);
 
-#ifdef RISCV_ENABLE_SIMPOINT
   if (p->get_simpoint())
   {
     reg_t opcode = fetch.insn.opcode();
@@ -279,10 +315,15 @@ static reg_t execute_insn(processor_t* p, reg_t pc, insn_fetch_t fetch)
     }
     p->get_pc_freqvec_tracker()->update_vec(pc);
   }
-#endif
   return npc;
 }
 
+bool processor_t::insn_hooks_active()
+{
+  return logging_on || mmu->tracing || commit_log_enabled ||
+         histogram_enabled || dbg_tracer->enabled() || simpoint_enabled;
+}
+
 static void update_timer(state_t* state, size_t instret)
 {
   uint64_t count0 = (uint64_t)(uint32_t)state->count;
@@ -297,31 +338,67 @@ static size_t next_timer(state_t* state)
   return state->compare - (uint32_t)state->count;
 }
 
+void processor_t::post_fault(reg_t cause, reg_t badvaddr)
+{
+  if (pending_trap != NULL)
+    return;
+
+  mem_trap_t* t;
+  switch (cause)
+  {
+    case CAUSE_MISALIGNED_FETCH: t = &fetch_misaligned_trap; break;
+    case CAUSE_FAULT_FETCH: t = &fetch_fault_trap; break;
+    case CAUSE_MISALIGNED_LOAD: t = &load_misaligned_trap; break;
+    case CAUSE_FAULT_LOAD: t = &load_fault_trap; break;
+    case CAUSE_MISALIGNED_STORE: t = &store_misaligned_trap; break;
+    default: t = &store_fault_trap; break;
+  }
+  t->set_badvaddr(badvaddr);
+  fault_xpr = state.XPR;
+  fault_fpr = state.FPR;
+  pending_trap = t;
 
-size_t processor_t::step(size_t n)
+  block_end = NULL;
+  // a fetch faults before its block runs, and the dispatcher sees that
+  if (threaded_block && t != &fetch_misaligned_trap && t != &fetch_fault_trap)
+    std::fill(threaded_block->threaded,
+              threaded_block->threaded + threaded_block->ninsns + 1,
+              threaded_fault_label);
+}
+
+template <class policy>
+reg_t processor_t::step_trap(trap_t& t, reg_t pc)
+{
+  pc = take_trap(t, pc);
+  if (policy::instrumented)
+  {
+    dbg_tracer->trace_after_take_trap(t, state.epc, pc);
+    if (trap_retires(t) && simpoint_enabled)
+      pc_freqvec_tracker->update_vec(pc);
+  }
+  return pc;
+}
+
+template <class policy>
+size_t processor_t::step_with(size_t n)
 {
   size_t instret = 0;
   reg_t pc = state.pc;
   mmu_t* _mmu = mmu;
-
-  #ifdef RISCV_ENABLE_DBG_TRACE
-    #define dbg_tracker_increment_instret() { dbg_tracer->increment_instret(); }
-  #else
-    #define dbg_tracker_increment_instret() {}
-  #endif
-
-  #ifdef RISCV_ENABLE_SIMPOINT
-    #define increment_num_bb_inst() { ++num_bb_inst; }
-  #else
-    #define increment_num_bb_inst() {}
-  #endif
+  // extensions catch the mmu's traps themselves
+  _mmu->post_faults = !policy::instrumented && !ext;
 
   #define increment_instret() { \
     ++instret; \
-    dbg_tracker_increment_instret(); \
-    increment_num_bb_inst(); \
+    if (policy::instrumented) { \
+      dbg_tracer->increment_instret(); \
+      ++num_bb_inst; \
+    } \
   };
 
+  if (unlikely(ipi_pending.load(std::memory_order_relaxed)) &&
+      ipi_pending.exchange(false) && run)
+    set_interrupt(IRQ_IPI, true);
   if (unlikely(!run || !n))
     return 0;
   n = std::min(n, next_timer(&state) | 1U);
@@ -330,60 +407,144 @@ size_t processor_t::step(size_t n)
   {
     take_interrupt();
 
-    if (unlikely(debug))
+    if (policy::instrumented && unlikely(debug))
     {
-      while (instret < n)
+      while (instret < n && likely(!pending_trap))
       {
-        insn_fetch_t fetch = mmu->load_insn(pc);
+        dbg_tracer->trace_before_insn_ic_fetch(pc);
+        icache_entry_t* entry = mmu->access_icache(pc);
+        mmu->trace_fetch(entry);
+        insn_fetch_t fetch = entry->data;
         disasm(fetch.insn);
-        pc = execute_insn(this, pc, fetch);
+        live_instret = instret;
+        pc = execute_insn<policy>(this, pc, fetch);
         increment_instret();
         fprintf(stderr,"RS1: %" PRIu64 " RS2: %" PRIu64 " RD: %" PRIu64 "\n",STATE.XPR[fetch.insn.rs1()],STATE.XPR[fetch.insn.rs2()],STATE.XPR[fetch.insn.rd()]);  \
       }
     }
-    else while (instret < n)
+    else
+    {
+      // the threaded and JIT dispatchers skip execute_insn, so they only
+      // run whole blocks while nothing is observing individual instructions
+      if (!policy::instrumented && dispatch == DISPATCH_THREADED)
+      {
+        if (rv64)
+          step_threaded<64>(pc, instret, n);
+        else
+          step_threaded<32>(pc, instret, n);
+      }
+      else if (!policy::instrumented && dispatch == DISPATCH_JIT)
+        step_jit(pc, instret, n);
+
+      while (instret < n && likely(!pending_trap))
       {
+        // run whole basic blocks while they fit in the budget, then finish
+        // the remainder one instruction at a time through the icache
+        if (!policy::instrumented ||
+            (likely(!logging_on) && _mmu->tracer.empty() && !dbg_tracer->enabled()))
+        {
+          bb_cache_entry_t* bb = _mmu->access_bb_cache(pc);
+          if (likely(bb->ninsns <= n - instret))
+          {
+            live_instret = instret + bb->ninsns - 1;
+            reg_t insn_pc = pc;
+            block_end = bb->data + bb->ninsns;
+            for (insn_fetch_t* fetch = bb->data; fetch < block_end; fetch++)
+            {
+              insn_pc = pc;
+              pc = execute_insn<policy>(this, pc, *fetch);
+              increment_instret();
+            }
+            // the instruction that faulted hasn't retired after all
+            if (insn_faulted())
+            {
+              pc = insn_pc;
+              instret--;
+            }
+            continue;
+          }
+        }
+
+        if (policy::instrumented)
+          dbg_tracer->trace_before_insn_ic_fetch(pc);
         size_t idx = _mmu->icache_index(pc);
         auto ic_entry = _mmu->access_icache(pc);
+        // the next entry belongs to the old privilege mode after a switch
+        icache_entry_t* bank = _mmu->icache;
 
 #define ICACHE_ACCESS(idx) { \
         insn_fetch_t fetch = ic_entry->data; \
-        if(logging_on) { \
+        if (policy::instrumented) \
+          _mmu->trace_fetch(ic_entry); \
+        if(policy::instrumented && logging_on) { \
           disasm(fetch.insn,pc); \
         } \
-        pc = execute_insn(this, pc, fetch); \
+        live_instret = instret; \
+        reg_t npc = execute_insn<policy>(this, pc, fetch); \
+        if (insn_faulted()) break; \
+        pc = npc; \
         ic_entry++; \
         increment_instret(); \
-        ifprintf(logging_on,stderr,"RS1: %" PRIu64 " RS2: %" PRIu64 " RD: %" PRIu64 "\n",STATE.XPR[fetch.insn.rs1()],STATE.XPR[fetch.insn.rs2()],STATE.XPR[fetch.insn.rd()]);  \
+        ifprintf(policy::instrumented && logging_on,stderr,"RS1: %" PRIu64 " RS2: %" PRIu64 " RD: %" PRIu64 "\n",STATE.XPR[fetch.insn.rs1()],STATE.XPR[fetch.insn.rs2()],STATE.XPR[fetch.insn.rd()]);  \
         if (unlikely(instret == n)) break; \
         if (idx == mmu_t::ICACHE_ENTRIES-1) break; \
         if (unlikely(ic_entry->tag != pc)) break; \
+        if (unlikely(_mmu->icache != bank)) break; \
       }
 
         switch (idx) {
 #include "icache.h"
         }
       }
+    }
   }
   catch(trap_t& t)
   {
-    pc = take_trap(t, pc);
-
-#ifdef RISCV_ENABLE_DBG_TRACE
-    dbg_tracer->trace_after_take_trap(t, state.epc, pc);
-#endif
+    pc = step_trap<policy>(t, pc);
     // without the following, scall and sbreak instructions will not be counted
-    if (dynamic_cast<trap_syscall*>(&t) || dynamic_cast<trap_breakpoint*>(&t)) {
-#ifdef RISCV_ENABLE_SIMPOINT
-      pc_freqvec_tracker->update_vec(pc);
-#endif
+    if (trap_retires(t))
       increment_instret();
-    }
   }
   catch(serialize_t& s) {}
+  _mmu->post_faults = false;
+
+  // scall and sbreak end their block, and have been counted; an access
+  // that faulted stopped the loop at its instruction, which is undone
+  if (unlikely(pending_trap != NULL))
+  {
+    trap_t* t = pending_trap;
+    pending_trap = NULL;
+    if (!trap_retires(*t))
+    {
+      state.XPR = fault_xpr;
+      state.FPR = fault_fpr;
+    }
+    pc = step_trap<policy>(*t, pc);
+  }
+
   state.pc = pc;
+  live_instret = 0;
   update_timer(&state, instret);
   return instret;
+
+  #undef increment_instret
+}
+
+size_t processor_t::step(size_t n)
+{
+  // the per-instruction hooks only exist in the instrumented instantiation,
+  // so a run that fast-forwards to where tracing or profiling starts goes
+  // through the plain one until then
+  if (unlikely(debug) || insn_hooks_active())
+  {
+    if (mmu->tracing)
+      mmu->resume_trace();
+    size_t instret = step_with<traced_policy_t>(n);
+    if (mmu->tracing)
+      mmu->flush_trace();
+    return instret;
+  }
+  return step_with<fast_policy_t>(n);
 }
 
 reg_t processor_t::take_trap(trap_t& t, reg_t epc)
@@ -407,22 +568,31 @@ reg_t processor_t::take_trap(trap_t& t, reg_t epc)
 
 void processor_t::deliver_ipi()
 {
-  if (run)
+  // the status register belongs to whichever thread is running this hart
+  if (concurrent)
+    ipi_pending = true;
+  else if (run)
     set_pcr(CSR_CLEAR_IPI, 1);
 }
 
+void processor_t::set_concurrent(bool value)
+{
+  concurrent = value;
+  mmu->set_concurrent(value);
+}
+
 void processor_t::disasm(insn_t insn)
 {
   uint64_t bits = insn.bits() & ((1ULL << (8 * insn_length(insn.bits()))) - 1);
   fprintf(stderr, "core %3d: 0x%016" PRIx64 " (0x%08" PRIx64 ") %s\n",
-          id, state.pc, bits, disassembler->disassemble(insn).c_str());
+          id, state.pc, bits, decoder->get_disassembler()->disassemble(insn).c_str());
 }
 
 void processor_t::disasm(insn_t insn,reg_t pc)
 {
   uint64_t bits = insn.bits() & ((1ULL << (8 * insn_length(insn.bits()))) - 1);
   fprintf(stderr, "core %3d: 0x%016" PRIx64 " (0x%08" PRIx64 ") %s\n",
-          id, pc, bits, disassembler->disassemble(insn).c_str());
+          id, pc, bits, decoder->get_disassembler()->disassemble(insn).c_str());
 }
 
 void processor_t::set_pcr(int which, reg_t val)
@@ -440,6 +610,8 @@ void processor_t::set_pcr(int which, reg_t val)
       state.frm = (val & FSR_RD) >> FSR_RD_SHIFT;
       break;
     case CSR_STATUS:
+    {
+      uint32_t old_sr = state.sr;
       state.sr = (val & ~SR_IP) | (state.sr & SR_IP);
 #ifndef RISCV_ENABLE_64BIT
       state.sr &= ~(SR_S64 | SR_U64);
@@ -451,19 +623,27 @@ void processor_t::set_pcr(int which, reg_t val)
         state.sr &= ~SR_EA;
       state.sr &= ~SR_ZERO;
       rv64 = (state.sr & SR_S) ? (state.sr & SR_S64) : (state.sr & SR_U64);
-      mmu->flush_tlb();
+      // what the TLB and the decoded instructions depend on besides SR_S,
+      // which selects their entries rather than invalidating them
+      if ((old_sr ^ state.sr) & SR_VM)
+        mmu->flush_tlb();
+      else if ((old_sr ^ state.sr) & (SR_S64 | SR_U64))
+        mmu->flush_icache();
+      mmu->set_supervisor(state.sr & SR_S);
       break;
+    }
     case CSR_EPC:
       state.epc = val;
       break;
     case CSR_EVEC:
       state.evec = val & ~3;
       break;
+    // step() adds all it has retired to the count when it returns
     case CSR_COUNT:
-      state.count = val;
+      state.count = val - live_instret;
       break;
     case CSR_COUNTH:
-      state.count = (val << 32) | (uint32_t)state.count;
+      state.count = ((val << 32) | (uint32_t)(state.count + live_instret)) - live_instret;
       break;
     case CSR_COMPARE:
       serialize();
@@ -471,6 +651,8 @@ void processor_t::set_pcr(int which, reg_t val)
       state.compare = val;
       break;
     case CSR_PTBR:
+      if ((val & ~(PGSIZE-1)) != state.ptbr)
+        mmu->flush_tlb();
       state.ptbr = val & ~(PGSIZE-1);
       break;
     case CSR_SEND_IPI:
@@ -527,16 +709,14 @@ reg_t processor_t::get_pcr(int which)
     case CSR_TIME:
     case CSR_INSTRET:
     case CSR_COUNT:
-      serialize();
-      return state.count;
+      return state.count + live_instret;
     case CSR_CYCLEH:
     case CSR_TIMEH:
     case CSR_INSTRETH:
     case CSR_COUNTH:
       if (rv64)
         break;
-      serialize();
-      return state.count >> 32;
+      return (state.count + live_instret) >> 32;
     case CSR_COMPARE:
       return state.compare;
     case CSR_CAUSE:
@@ -560,10 +740,12 @@ reg_t processor_t::get_pcr(int which)
     case CSR_SUP1:
       return state.pcr_k1;
     case CSR_TOHOST:
-      sim->get_htif()->tick(); // not necessary, but faster
+      if (!concurrent)
+        sim->get_htif()->tick(); // not necessary, but faster
       return state.tohost;
     case CSR_FROMHOST:
-      sim->get_htif()->tick(); // not necessary, but faster
+      if (!concurrent)
+        sim->get_htif()->tick(); // not necessary, but faster
       return state.fromhost;
     case CSR_UARCH0:
     case CSR_UARCH1:
@@ -602,66 +784,15 @@ reg_t illegal_instruction(processor_t* p, insn_t insn, reg_t pc)
 
 insn_func_t processor_t::decode_insn(insn_t insn)
 {
-  size_t mask = opcode_map.size()-1;
-  insn_desc_t* desc = opcode_map[insn.bits() & mask];
-
-  while ((insn.bits() & desc->mask) != desc->match)
-    desc++;
-
-  return rv64 ? desc->rv64 : desc->rv32;
-}
-
-void processor_t::register_insn(insn_desc_t desc)
-{
-  assert(desc.mask & 1);
-  instructions.push_back(desc);
-}
-
-void processor_t::build_opcode_map()
-{
-  size_t buckets = -1;
-  for (auto& inst : instructions)
-    while ((inst.mask & buckets) != buckets)
-      buckets /= 2;
-  buckets++;
-
-  struct cmp {
-    decltype(insn_desc_t::match) mask;
-    cmp(decltype(mask) mask) : mask(mask) {}
-    bool operator()(const insn_desc_t& lhs, const insn_desc_t& rhs) {
-      if ((lhs.match & mask) != (rhs.match & mask))
-        return (lhs.match & mask) < (rhs.match & mask);
-      return lhs.match < rhs.match;
-    }
-  };
-  std::sort(instructions.begin(), instructions.end(), cmp(buckets-1));
-
-  opcode_map.resize(buckets);
-  opcode_store.resize(instructions.size() + 1);
-
-  size_t j = 0;
-  for (size_t b = 0, i = 0; b < buckets; b++)
-  {
-    opcode_map[b] = &opcode_store[j];
-    while (i < instructions.size() && b == (instructions[i].match & (buckets-1)))
-      opcode_store[j++] = instructions[i++];
-  }
-
-  assert(j == opcode_store.size()-1);
-  opcode_store[j].match = opcode_store[j].mask = 0;
-  opcode_store[j].rv32 = &illegal_instruction;
-  opcode_store[j].rv64 = &illegal_instruction;
+  return handler(decoder->decode(insn.bits()));
 }
 
 void processor_t::register_extension(extension_t* x)
 {
-  for (auto insn : x->get_instructions())
-    register_insn(insn);
-  build_opcode_map();
-  for (auto disasm_insn : x->get_disasms())
-    disassembler->add_insn(disasm_insn);
   if (ext != NULL)
     throw std::logic_error("only one extension may be registered");
+  decoder = sim->get_decoder(x);
+  mmu->flush_icache();
   ext = x;
   x->set_processor(this);
 }
@@ -3,10 +3,12 @@
 #define _RISCV_PROCESSOR_H
 
 #include "decode.h"
+#include "trap.h"
 #include "config.h"
 #include <cstring>
 #include <vector>
 #include <map>
+#include <atomic>
 
 class processor_t;
 class mmu_t;
@@ -15,9 +17,13 @@ class sim_t;
 class trap_t;
 class extension_t;
 class disassembler_t;
+class decoder_t;
 class bb_tracker_t;
 class debug_tracer_t;
 class pc_freqvec_tracker_t;
+class jit_t;
+struct bb_cache_entry_t;
+struct insn_fetch_t;
 
 struct insn_desc_t
 {
@@ -25,6 +31,18 @@ struct insn_desc_t
   uint32_t mask;
   insn_func_t rv32;
   insn_func_t rv64;
+  // the same handlers reporting register and memory accesses to the debug
+  // tracer and commit log; NULL means the plain ones already do
+  insn_func_t rv32_traced;
+  insn_func_t rv64_traced;
+};
+
+// how step() moves from one instruction handler to the next
+enum dispatch_t
+{
+  DISPATCH_LOOP, // call through the decoded handler pointers
+  DISPATCH_THREADED, // jump between inlined handlers (see threaded.cc)
+  DISPATCH_JIT, // run hot blocks as translated host code (see jit.cc)
 };
 
 struct commit_log_reg_t
@@ -59,10 +77,6 @@ struct state_t
   uint32_t frm;
 
   reg_t load_reservation;
-
-#ifdef RISCV_ENABLE_COMMITLOG
-  commit_log_reg_t log_reg_write;
-#endif
 };
 
 // this class represents one processor in a RISC-V machine.
@@ -74,6 +88,10 @@ public:
 
   void set_debug(bool value);
   void set_histogram(bool value);
+  bool get_histogram() { return histogram_enabled; }
+  void set_commit_log(bool value);
+  bool get_commit_log() { return commit_log_enabled; }
+  void set_dispatch(dispatch_t value);
   void reset(bool value);
   size_t step(size_t n); // run for n cycles
   void deliver_ipi(); // register an interprocessor interrupt
@@ -87,11 +105,42 @@ public:
   extension_t* get_extension() { return ext; }
   uint32_t get_id() { return id; }
   void yield_load_reservation() { state.load_reservation = (reg_t)-1; }
+  // set while other harts run on their own host threads (see
+  // sim_t::set_parallel); IPIs and HTIF polling then go through step()
+  void set_concurrent(bool value);
   void update_histogram(size_t pc);
+  void commit_log(reg_t pc, insn_t insn); // print and clear the last write
+
+  // an instruction that ends its basic block can raise a trap by posting
+  // it here and leaving npc at its own pc; step() delivers it at the block
+  // boundary instead of unwinding. scall and sbreak post these two.
+  void post_trap(trap_t* t) { pending_trap = t; }
+  trap_t* get_pending_trap() { return pending_trap; }
+  trap_syscall syscall_trap;
+  trap_breakpoint breakpoint_trap;
+
+  // a load, store or fetch that faults in the middle of a block posts its
+  // trap too, when the mmu is set to (see mmu_t::fault). the instruction
+  // runs on to its end against a scratch location, so step() puts back the
+  // registers it had, and stops at it without retiring it. only the first
+  // fault an instruction posts counts.
+  void post_fault(reg_t cause, reg_t badvaddr);
+  // whether the instruction just run faulted, rather than completing
+  bool insn_faulted()
+  {
+    return unlikely(pending_trap != NULL) && !trap_retires(*pending_trap);
+  }
+  // scall and sbreak complete before they trap, so they count as retired
+  static bool trap_retires(trap_t& t)
+  {
+    return t.cause() == CAUSE_SYSCALL || t.cause() == CAUSE_BREAKPOINT;
+  }
+
+  // the value lr.w/lr.d loaded; sc.w/sc.d only store if memory still holds
+  // it, which is what makes the pair atomic against concurrent harts
+  reg_t load_reservation_value;
 
-  void register_insn(insn_desc_t);
   void register_extension(extension_t*);
-#ifdef RISCV_ENABLE_SIMPOINT
   bool simpoint_enabled;
   uint64_t num_bb_inst;
   bb_tracker_t* get_bbt() { return bbt; }
@@ -99,44 +148,66 @@ public:
   void set_simpoint(bool enable, size_t interval);
 
   bool get_simpoint() { return simpoint_enabled; };
-#endif
 
-#ifdef RISCV_ENABLE_DBG_TRACE
   void enable_trace(size_t n);
   void enable_insn_info_collection();
+  // write out and close what simpoint and tracing have open, as deleting
+  // the processor does, and go on without them
+  void close_outputs();
   debug_tracer_t* get_dbg_tracer() { return dbg_tracer; };
   reg_t rd_xpr(size_t rn, operand_t operand);
   void wr_xpr(size_t rn, reg_t val);
   freg_t rd_fpr(size_t rn, operand_t operand);
   void wr_fpr(size_t rn, freg_t val);
-#endif
 
 private:
   sim_t* sim;
   mmu_t* mmu; // main memory is always accessed via the mmu
   extension_t* ext;
-  disassembler_t* disassembler;
+  const decoder_t* decoder; // the simulator's, for ext
 
-#ifdef RISCV_ENABLE_SIMPOINT
   bb_tracker_t* bbt;
   pc_freqvec_tracker_t* pc_freqvec_tracker;
-#endif
-
-#ifdef RISCV_ENABLE_DBG_TRACE
   debug_tracer_t* dbg_tracer;
-#endif
 
   state_t state;
   uint32_t id;
   bool run; // !reset
   bool debug;
   bool histogram_enabled;
+  bool commit_log_enabled;
+  commit_log_reg_t log_reg_write;
+  bool traced_handlers; // decode to the rv32/rv64_traced handlers
   bool rv64;
   bool serialized;
+  dispatch_t dispatch;
+  jit_t* jit;
+  trap_t* pending_trap;
+  // what post_fault posts, and the registers from before the instruction
+  trap_instruction_address_misaligned fetch_misaligned_trap;
+  trap_instruction_access_fault fetch_fault_trap;
+  trap_load_address_misaligned load_misaligned_trap;
+  trap_load_access_fault load_fault_trap;
+  trap_store_address_misaligned store_misaligned_trap;
+  trap_store_access_fault store_fault_trap;
+  regfile_t<reg_t, NXPR, true> fault_xpr;
+  regfile_t<freg_t, NFPR, false> fault_fpr;
+  // where the block step() is running ends; post_fault empties it, so the
+  // block stops after an access that faults without step() looking for
+  // one after every instruction
+  insn_fetch_t* block_end;
+  // likewise, the block the threaded dispatcher is running, if it is, and
+  // the label post_fault points the rest of the block's labels at on a
+  // load or store fault
+  bb_cache_entry_t* threaded_block;
+  const void* threaded_fault_label;
+  // instructions the current step() has retired before the one it is
+  // running, as far as reading the counter CSRs is concerned. these only
+  // ever end a basic block, so a whole block can publish it up front.
+  size_t live_instret;
+  bool concurrent;
+  std::atomic<bool> ipi_pending; // sent from another host thread
 
-  std::vector<insn_desc_t> instructions;
-  std::vector<insn_desc_t*> opcode_map;
-  std::vector<insn_desc_t> opcode_store;
   std::map<size_t,size_t> pc_histogram;
 
   void take_interrupt(); // take a trap if any interrupts are pending
@@ -144,20 +215,61 @@ private:
   reg_t take_trap(trap_t& t, reg_t epc); // take an exception
   void disasm(insn_t insn); // disassemble and print an instruction
   void disasm(insn_t insn,reg_t pc); // disassemble and print an instruction
+  bool insn_hooks_active(); // whether execute_insn has per-instruction work
+  void update_handlers(); // switch handler sets if tracing has changed
+  template <class policy>
+  size_t step_with(size_t n);
+  template <class policy>
+  reg_t step_trap(trap_t& t, reg_t pc);
+  template <int xlen>
+  void step_threaded(reg_t& pc, size_t& instret, size_t n);
+  void step_jit(reg_t& pc, size_t& instret, size_t n);
 
   friend class sim_t;
   friend class mmu_t;
   friend class extension_t;
 
-  void build_opcode_map();
   insn_func_t decode_insn(insn_t insn);
+  // the handler of desc for the mode this processor is in
+  insn_func_t handler(const insn_desc_t* desc)
+  {
+    if (unlikely(traced_handlers))
+      return rv64 ? desc->rv64_traced : desc->rv32_traced;
+    return rv64 ? desc->rv64 : desc->rv32;
+  }
 };
 
 reg_t illegal_instruction(processor_t* p, insn_t insn, reg_t pc);
 
-#define REGISTER_INSN(proc, name, match, mask) \
-  extern reg_t rv32_##name(processor_t*, insn_t, reg_t); \
-  extern reg_t rv64_##name(processor_t*, insn_t, reg_t); \
-  proc->register_insn((insn_desc_t){match, mask, rv32_##name, rv64_##name});
+// the instrumentation policy that step() and the instruction handlers are
+// instantiated on. this one does nothing beyond the architectural effect of
+// each instruction; traced_policy_t (mmu.h) reports every register and
+// memory access, and lets step() run the per-instruction hooks.
+struct fast_policy_t
+{
+  static const bool instrumented = false;
+
+  static reg_t read_xpr(processor_t* p, size_t rn, operand_t)
+  {
+    return p->get_state()->XPR[rn];
+  }
+  static void write_xpr(processor_t* p, size_t rn, reg_t val)
+  {
+    p->get_state()->XPR.write(rn, val);
+  }
+  static freg_t read_fpr(processor_t* p, size_t rn, operand_t)
+  {
+    return p->get_state()->FPR[rn];
+  }
+  static void write_fpr(processor_t* p, size_t rn, freg_t val)
+  {
+    p->get_state()->FPR.write(rn, val);
+  }
+  static mmu_t& mmu(processor_t* p) { return *p->get_mmu(); }
+};
+
+// the policy the register and memory macros in decode.h use outside of the
+// handler templates, e.g. in extensions
+typedef fast_policy_t insn_policy_t;
 
 #endif
@@ -0,0 +1,162 @@
+// See LICENSE for license details.
+
+#include "raw_ckpt.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool pwrite_all(int fd, const void* buf, size_t len, off_t off)
+{
+  const char* p = (const char*)buf;
+  while (len)
+  {
+    ssize_t n = pwrite(fd, p, len, off);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+    off += n;
+  }
+  return true;
+}
+
+static bool pread_all(int fd, void* buf, size_t len, off_t off)
+{
+  char* p = (char*)buf;
+  while (len)
+  {
+    ssize_t n = pread(fd, p, len, off);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+    off += n;
+  }
+  return true;
+}
+
+raw_ckpt_t::~raw_ckpt_t()
+{
+  if (fd >= 0)
+    close(fd);
+}
+
+bool raw_ckpt_t::write(const std::string& name, const std::string& htif,
+                       const std::string& regs, target_mem_t* mem)
+{
+  uint64_t pgsize = mem->page_size();
+  uint64_t npages = mem->size() / pgsize;
+  std::vector<uint64_t> bits((npages + 63) / 64);
+  for (uint64_t page = 0; page < npages; page++)
+    if (mem->page_written(page * pgsize) && !mem->page_is_zero(page * pgsize))
+      bits[page / 64] |= uint64_t(1) << (page % 64);
+
+  header_t h = header_t();
+  h.signature = SIGNATURE;
+  h.memsz = npages * pgsize;
+  h.pgsize = pgsize;
+  h.regs_offset = sizeof(h);
+  h.regs_size = regs.size();
+  h.bitmap_offset = h.regs_offset + h.regs_size;
+  h.bitmap_size = bits.size() * sizeof(uint64_t);
+  h.htif_offset = h.bitmap_offset + h.bitmap_size;
+  h.htif_size = htif.size();
+  h.mem_offset = (h.htif_offset + h.htif_size + ALIGN - 1) / ALIGN * ALIGN;
+
+  int fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return false;
+
+  bool ok = pwrite_all(fd, &h, sizeof(h), 0) &&
+            pwrite_all(fd, regs.data(), h.regs_size, h.regs_offset) &&
+            pwrite_all(fd, bits.data(), h.bitmap_size, h.bitmap_offset) &&
+            pwrite_all(fd, htif.data(), h.htif_size, h.htif_offset);
+
+  // one write per run of pages; the gaps stay holes
+  for (uint64_t page = 0; ok && page < npages; )
+  {
+    uint64_t end = page;
+    while (end < npages && ((bits[end / 64] >> (end % 64)) & 1))
+      end++;
+    if (end > page)
+      ok = pwrite_all(fd, mem->data() + page * pgsize, (end - page) * pgsize,
+                      h.mem_offset + page * pgsize);
+    page = end + 1;
+  }
+
+  ok = ok && ftruncate(fd, h.mem_offset + h.memsz) == 0;
+  return close(fd) == 0 && ok;
+}
+
+bool raw_ckpt_t::is_raw(const std::string& name)
+{
+  raw_ckpt_t ckpt;
+  uint64_t signature;
+  ckpt.fd = ::open(name.c_str(), O_RDONLY);
+  return ckpt.fd >= 0 &&
+         pread_all(ckpt.fd, &signature, sizeof(signature), 0) &&
+         signature == SIGNATURE;
+}
+
+bool raw_ckpt_t::open(const std::string& name)
+{
+  struct stat st;
+  if ((fd = ::open(name.c_str(), O_RDONLY)) < 0 ||
+      !pread_all(fd, &header, sizeof(header), 0) ||
+      header.signature != SIGNATURE ||
+      header.pgsize == 0 || header.memsz % header.pgsize != 0 ||
+      header.bitmap_size < (header.memsz / header.pgsize + 63) / 64 * sizeof(uint64_t) ||
+      fstat(fd, &st) != 0 || uint64_t(st.st_size) < header.mem_offset + header.memsz)
+    return false;
+
+  htif_log.resize(header.htif_size);
+  reg_state.resize(header.regs_size);
+  bitmap.resize(header.bitmap_size / sizeof(uint64_t));
+  return pread_all(fd, &htif_log[0], header.htif_size, header.htif_offset) &&
+         pread_all(fd, &reg_state[0], header.regs_size, header.regs_offset) &&
+         pread_all(fd, bitmap.data(), header.bitmap_size, header.bitmap_offset);
+}
+
+bool raw_ckpt_t::map_memory(target_mem_t* mem)
+{
+  uint64_t pgsize = header.pgsize;
+  uint64_t len = std::min<uint64_t>(header.memsz, mem->size()) / pgsize * pgsize;
+  for (uint64_t page = len / pgsize; page < header.memsz / pgsize; page++)
+    if (page_present(page))
+    {
+      fprintf(stderr, "Checkpoint uses memory beyond 0x%lx; increase -m\n",
+              (unsigned long)mem->size());
+      return false;
+    }
+
+  // memory past the image ends up zero, whatever was loaded into it before
+  for (uint64_t paddr = len; paddr < mem->size(); paddr += mem->page_size())
+    if (mem->page_written(paddr))
+      memset(mem->data() + paddr, 0, mem->page_size());
+
+  if (header.mem_offset % sysconf(_SC_PAGESIZE) != 0 ||
+      !mem->map_file(fd, header.mem_offset, len))
+  {
+    // read the pages in instead
+    for (uint64_t paddr = 0; paddr < len; paddr += mem->page_size())
+      if (mem->page_written(paddr))
+        memset(mem->data() + paddr, 0, mem->page_size());
+    for (uint64_t page = 0; page < len / pgsize; page++)
+      if (page_present(page) &&
+          !pread_all(fd, mem->data() + page * pgsize, pgsize,
+                     header.mem_offset + page * pgsize))
+      {
+        perror("reading checkpoint memory");
+        return false;
+      }
+  }
+
+  for (uint64_t page = 0; page < len / pgsize; page++)
+    if (page_present(page))
+      for (uint64_t off = 0; off < pgsize; off += mem->page_size())
+        mem->mark_written(page * pgsize + off);
+  return true;
+}
@@ -0,0 +1,69 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_RAW_CKPT_H
+#define _RISCV_RAW_CKPT_H
+
+#include "target_mem.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// an uncompressed checkpoint, laid out so that restoring it maps the memory
+// image instead of reading it. a header at the start locates the HTIF log,
+// the register checkpoint and a bitmap of the pages that hold data; memory
+// follows at an offset aligned for any host's pages, as an image of the
+// whole of it in which the empty pages are holes in the file.
+class raw_ckpt_t
+{
+public:
+  raw_ckpt_t() : fd(-1) {}
+  ~raw_ckpt_t();
+
+  // write a checkpoint of the given HTIF log and register checkpoint, and
+  // of those pages of mem that are not zero
+  static bool write(const std::string& name, const std::string& htif,
+                    const std::string& regs, target_mem_t* mem);
+
+  // read the header, HTIF log and register checkpoint of a checkpoint.
+  // memory is only touched by map_memory.
+  bool open(const std::string& name);
+  const std::string& htif() { return htif_log; }
+  const std::string& regs() { return reg_state; }
+
+  // make the checkpoint's memory the contents of mem. the pages are mapped
+  // copy-on-write, so only those the target goes on to use are read.
+  // reports why and returns false if that is not possible, e.g. because
+  // the checkpoint holds data beyond the end of mem.
+  bool map_memory(target_mem_t* mem);
+
+  // whether the file starts like a raw checkpoint
+  static bool is_raw(const std::string& name);
+
+private:
+  struct header_t
+  {
+    uint64_t signature;
+    uint64_t memsz;
+    uint64_t pgsize;
+    uint64_t htif_offset, htif_size;
+    uint64_t regs_offset, regs_size;
+    uint64_t bitmap_offset, bitmap_size;
+    uint64_t mem_offset;
+  };
+
+  static const uint64_t SIGNATURE = 0xbaadbeef4a3c4b50;
+  static const uint64_t ALIGN = 1 << 16;
+
+  int fd;
+  header_t header;
+  std::string htif_log;
+  std::string reg_state;
+  std::vector<uint64_t> bitmap;
+
+  bool page_present(uint64_t page)
+  {
+    return (bitmap[page / 64] >> (page % 64)) & 1;
+  }
+};
+
+#endif
@@ -0,0 +1,242 @@
+// See LICENSE for license details.
+
+#include "region_runner.h"
+#include "sim.h"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static std::string trim(const std::string& str, const std::string& chars = "\t\n\v\f\r ")
+{
+  size_t begin = str.find_first_not_of(chars);
+  if (begin == std::string::npos)
+    return "";
+  return str.substr(begin, str.find_last_not_of(chars) + 1 - begin);
+}
+
+region_list region_file_read(const std::string& filepath) noexcept(false)
+{
+  region_list result;
+
+  std::ifstream region_file(filepath);
+  if (!region_file.good())
+    throw std::runtime_error("Cannot open '" + filepath + "'.");
+
+  std::string line;
+  while (std::getline(region_file, line)) {
+    line = trim(line);
+    if (line.empty())
+      continue;
+
+    size_t pos = line.find_last_of(':');
+    if (pos == std::string::npos)
+      throw std::runtime_error("Region '" + line + "' has no weight.");
+
+    region_t region;
+    region.checkpoint = trim(line.substr(0, pos));
+    std::istringstream weight_in(trim(line.substr(pos + 1)));
+    weight_in >> region.weight;
+    if (weight_in.fail() || !weight_in.eof() || region.weight < 0 ||
+        region.checkpoint.empty())
+      throw std::runtime_error("Region '" + line + "' contains an invalid weight.");
+    result.push_back(region);
+  }
+
+  if (result.empty())
+    throw std::runtime_error("empty region list");
+  return result;
+}
+
+region_runner_t::region_runner_t(sim_t* sim, const std::vector<cache_sim_t*>& caches)
+  : sim(sim), caches(caches)
+{
+}
+
+bool region_runner_t::run(const region_list& list, size_t insns, size_t jobs)
+{
+  regions = list;
+  results.assign(regions.size(), result_t());
+  jobs = std::max(jobs, size_t(1));
+
+  std::vector<worker_t> workers;
+  size_t next = 0;
+  while (next < regions.size() || !workers.empty())
+  {
+    if (next < regions.size() && workers.size() < jobs)
+    {
+      size_t i = next++;
+      int fds[2];
+      if (pipe(fds) != 0) {
+        perror("pipe");
+        continue;
+      }
+
+      fflush(NULL);
+      std::cout.flush();
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(fds[0]);
+        for (size_t j = 0; j < workers.size(); j++)
+          close(workers[j].fd);
+        run_region(regions[i], insns, fds[1]);
+      }
+      close(fds[1]);
+      if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        continue;
+      }
+      workers.push_back(worker_t{pid, fds[0], i});
+      continue;
+    }
+
+    int status = 0;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0 && errno == EINTR)
+      continue;
+    for (size_t j = 0; j < workers.size(); j++)
+    {
+      if (pid < 0 || workers[j].pid == pid)
+      {
+        finish(workers[j], pid < 0 ? -1 : status);
+        workers.erase(workers.begin() + j);
+        break;
+      }
+    }
+  }
+
+  bool ok = true;
+  for (size_t i = 0; i < results.size(); i++)
+    ok &= results[i].ok;
+  return ok;
+}
+
+// runs in the worker, which reports the instructions it retired and what
+// the caches counted over the region, and never returns
+void region_runner_t::run_region(const region_t& region, size_t insns, int fd)
+{
+  sim->reconnect_host();
+  sim->boot();
+  fprintf(stderr, "Running region %s for %lu instructions\n",
+          region.checkpoint.c_str(), (unsigned long)insns);
+  bool ok = sim->restore_checkpoint(region.checkpoint);
+
+  uint64_t instret = 0;
+  std::vector<cache_sim_t::stats_t> stats(caches.size());
+  for (size_t i = 0; i < sim->num_cores(); i++)
+    instret -= sim->get_core(i)->get_state()->count;
+  for (size_t i = 0; i < caches.size(); i++)
+    stats[i] = caches[i]->get_stats();
+
+  // a program that ends within the region still counts what it ran
+  if (ok)
+    sim->run(insns);
+
+  for (size_t i = 0; i < sim->num_cores(); i++)
+    instret += sim->get_core(i)->get_state()->count;
+  for (size_t i = 0; i < caches.size(); i++)
+  {
+    cache_sim_t::stats_t now = caches[i]->get_stats();
+    stats[i] = now -= stats[i];
+  }
+
+  size_t len = stats.size() * sizeof(stats[0]);
+  ok = ok && write(fd, &instret, sizeof(instret)) == sizeof(instret) &&
+       write(fd, stats.data(), len) == ssize_t(len);
+  fflush(NULL);
+  _exit(ok ? 0 : 1);
+}
+
+static bool read_all(int fd, void* buf, size_t len)
+{
+  for (size_t done = 0; done < len; )
+  {
+    ssize_t n = read(fd, (char*)buf + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+void region_runner_t::finish(const worker_t& worker, int status)
+{
+  result_t& result = results[worker.region];
+  result.caches.resize(caches.size());
+  result.ok = status >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+              read_all(worker.fd, &result.instret, sizeof(result.instret)) &&
+              read_all(worker.fd, result.caches.data(),
+                       result.caches.size() * sizeof(result.caches[0]));
+  close(worker.fd);
+
+  if (!result.ok)
+    std::cerr << "ERROR: Region " << regions[worker.region].checkpoint << " failed.\n";
+}
+
+void region_runner_t::print_summary()
+{
+  double weights = 0, instret = 0;
+  std::vector<std::vector<double>> sums(caches.size(), std::vector<double>(7));
+
+  std::cout << std::setprecision(3) << std::fixed;
+  for (size_t i = 0; i < regions.size(); i++)
+  {
+    const result_t& result = results[i];
+    std::cout << "Region " << regions[i].checkpoint << " (weight "
+              << regions[i].weight << "): ";
+    if (!result.ok) {
+      std::cout << "failed" << std::endl;
+      continue;
+    }
+    std::cout << result.instret << " instructions" << std::endl;
+
+    double w = regions[i].weight;
+    weights += w;
+    instret += w * result.instret;
+    for (size_t j = 0; j < caches.size(); j++)
+    {
+      const cache_sim_t::stats_t& s = result.caches[j];
+      const uint64_t counts[7] = {s.bytes_read, s.bytes_written, s.read_accesses,
+                                  s.write_accesses, s.read_misses, s.write_misses,
+                                  s.writebacks};
+      for (size_t k = 0; k < 7; k++)
+        sums[j][k] += w * counts[k];
+    }
+  }
+
+  if (weights == 0)
+    return;
+
+  // everything is per region, averaged by weight
+  std::cout << std::left;
+  std::cout << std::setw(32) << "Weighted Instructions:" << instret / weights << std::endl;
+  static const char* const labels[7] = {
+    "Bytes Read:", "Bytes Written:", "Read Accesses:", "Write Accesses:",
+    "Read Misses:", "Write Misses:", "Writebacks:"
+  };
+  for (size_t j = 0; j < caches.size(); j++)
+  {
+    const std::string& name = caches[j]->get_name();
+    for (size_t k = 0; k < 7; k++)
+      std::cout << name << " " << std::setw(28) << std::string("Weighted ") + labels[k]
+                << sums[j][k] / weights << std::endl;
+
+    double accesses = sums[j][2] + sums[j][3], misses = sums[j][4] + sums[j][5];
+    if (accesses > 0)
+      std::cout << name << " " << std::setw(28) << "Weighted Miss Rate:"
+                << 100 * misses / accesses << '%' << std::endl;
+    if (instret > 0)
+      std::cout << name << " " << std::setw(28) << "Weighted MPKI:"
+                << 1000 * misses / instret << std::endl;
+  }
+  std::cout << std::right;
+}
@@ -0,0 +1,62 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_REGION_RUNNER_H
+#define _RISCV_REGION_RUNNER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include "cachesim.h"
+
+class sim_t;
+
+// a piece of a program to simulate: the checkpoint it starts from, and how
+// much it counts towards the whole program, as SimPoint weighs it
+struct region_t
+{
+  std::string checkpoint;
+  double weight;
+};
+
+typedef std::vector<region_t> region_list;
+
+// reads lines of the form "<checkpoint>: <weight>"
+region_list region_file_read(const std::string& filepath) noexcept(false);
+
+// runs regions, each in a forked copy of one simulator that is only set up
+// once, a few at a time, and adds up what they counted by weight
+class region_runner_t
+{
+public:
+  region_runner_t(sim_t* sim, const std::vector<cache_sim_t*>& caches);
+
+  // run every region for insns instructions, jobs of them at once, and
+  // report whether they all got through
+  bool run(const region_list& regions, size_t insns, size_t jobs);
+  void print_summary();
+
+private:
+  struct result_t
+  {
+    bool ok;
+    uint64_t instret;
+    std::vector<cache_sim_t::stats_t> caches;
+  };
+  struct worker_t
+  {
+    pid_t pid;
+    int fd; // where its result comes in
+    size_t region;
+  };
+
+  sim_t* sim;
+  std::vector<cache_sim_t*> caches;
+  region_list regions;
+  std::vector<result_t> results;
+
+  void run_region(const region_t& region, size_t insns, int fd);
+  void finish(const worker_t& worker, int status);
+};
+
+#endif
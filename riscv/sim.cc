@@ -6,11 +6,21 @@
 #include <iostream>
 #include <climits>
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
+#include <errno.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <iostream>
 #include <fstream>
-#include <gzstream.h>
+#include <sstream>
+#include "pgzstream.h"
+#include "raw_ckpt.h"
+#include "page_store.h"
+#include "decoder.h"
+#include "extension.h"
 
 bool logging_on             = false;
 
@@ -24,36 +34,40 @@ static void handle_signal(int sig)
 }
 
 sim_t::sim_t(size_t nprocs, size_t mem_mb, const std::vector<std::string>& args)
-  : htif(new htif_isasim_t(this, args)), procs(std::max(nprocs, size_t(1))),
-    current_step(0), current_proc(0), debug(false), checkpointing_enabled(false)
+  : htif_args(args), htif(args.empty() ? NULL : new htif_isasim_t(this, args)), procs(std::max(nprocs, size_t(1))),
+    current_step(0), current_proc(0), debug(false), checkpointing_enabled(false),
+    checkpoint_format(CKPT_DENSE), checkpoint_delta(false),
+    checkpoint_jobs(0), ckpt_writer_failed(false),
+    parallel_quantum(0), parallel_deterministic(false)
 {
   signal(SIGINT, &handle_signal);
-  // allocate target machine's memory, shrinking it as necessary
-  // until the allocation succeeds
+  // reserve target machine's memory; pages are only committed once the
+  // target writes them
   size_t memsz0 = (size_t)mem_mb << 20;
-  size_t quantum = 1L << 20;
   if (memsz0 == 0)
     memsz0 = 1L << (sizeof(size_t) == 8 ? 32 : 30);
 
-  memsz = memsz0;
   fprintf(stderr, "Requesting target memory 0x%lx\n",(unsigned long)memsz0);
-  while ((mem = (char*)calloc(1, memsz)) == NULL)
-    memsz = memsz*10/11/quantum*quantum;
+  target_mem.reset(new target_mem_t(memsz0, PGSIZE));
+  mem = target_mem->data();
+  memsz = target_mem->size();
 
   if (memsz != memsz0)
     fprintf(stderr, "warning: only got %lu bytes of target mem (wanted %lu)\n",
             (unsigned long)memsz, (unsigned long)memsz0);
 
-  debug_mmu = new mmu_t(mem, memsz);
+  debug_mmu = new mmu_t(target_mem.get());
 
   for (size_t i = 0; i < procs.size(); i++) {
-    procs[i] = new processor_t(this, new mmu_t(mem, memsz), i);
+    procs[i] = new processor_t(this, new mmu_t(target_mem.get()), i);
   }
 
 }
 
 sim_t::~sim_t()
 {
+  wait_checkpoints();
+  stop_hart_threads();
   for (size_t i = 0; i < procs.size(); i++)
   {
     mmu_t* pmmu = procs[i]->get_mmu();
@@ -61,7 +75,20 @@ sim_t::~sim_t()
     delete pmmu;
   }
   delete debug_mmu;
-  free(mem);
+}
+
+// the host runs on a thread of its own, which a fork does not copy, so the
+// old one cannot be torn down either
+void sim_t::reconnect_host()
+{
+  reconnect_host(htif_args);
+}
+
+void sim_t::reconnect_host(const std::vector<std::string>& args)
+{
+  htif_args = args;
+  htif.release();
+  htif.reset(new htif_isasim_t(this, htif_args));
 }
 
 void sim_t::send_ipi(reg_t who)
@@ -85,17 +112,135 @@ void sim_t::boot()
   // This tick will initialize the processor.
 	bool htif_return = htif->tick();
 
+  if (!boot_cache.empty())
+  {
+    // one that cannot be read is taken again
+    std::string snapshot = boot_snapshot_name();
+    if (!raw_ckpt_t::is_raw(snapshot) || !restore_raw_checkpoint(snapshot))
+      boot_to_user(snapshot);
+  }
+}
+
+void sim_t::set_boot_cache(const std::string& dir)
+{
+  boot_cache = dir;
+  while (boot_cache.size() > 1 && boot_cache[boot_cache.size() - 1] == '/')
+    boot_cache.erase(boot_cache.size() - 1);
+  if (!boot_cache.empty())
+    mkdir(boot_cache.c_str(), 0777);
+}
+
+// snapshots are named after all that goes into the machine before it
+// boots: its size and extensions, the program the host has loaded by now,
+// wherever it found it, and the arguments, with the contents of those that
+// name files the target may go on to open.
+std::string sim_t::boot_snapshot_name()
+{
+  std::string key = std::to_string(procs.size()) + " " + std::to_string(memsz);
+  for (size_t i = 0; i < procs.size(); i++)
+  {
+    extension_t* x = procs[i]->get_extension();
+    key += '\0' + std::string(x ? x->name() : "");
+  }
+
+  uint64_t pgsize = target_mem->page_size();
+  for (reg_t paddr = 0; paddr < memsz; paddr += pgsize)
+  {
+    if (!target_mem->page_written(paddr))
+      continue;
+    page_store_t::hash_t h = page_store_t::hash(mem + paddr, pgsize);
+    key += '\0' + std::to_string(paddr) + ':' + std::to_string(h.hi) +
+           std::to_string(h.lo);
+  }
+
+  for (size_t i = 0; i < htif_args.size(); i++)
+  {
+    key += '\0' + htif_args[i];
+    struct stat st;
+    if (stat(htif_args[i].c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    std::ifstream file(htif_args[i].c_str(), std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(file)),
+                         std::istreambuf_iterator<char>());
+    page_store_t::hash_t h = page_store_t::hash(contents.data(), contents.size());
+    key += '\0' + std::to_string(h.hi) + std::to_string(h.lo);
+  }
+
+  page_store_t::hash_t h = page_store_t::hash(key.data(), key.size());
+  char name[48];
+  snprintf(name, sizeof(name), "/boot-%016llx%016llx.raw",
+           (unsigned long long)h.hi, (unsigned long long)h.lo);
+  return boot_cache + name;
+}
+
+// run on from reset until a processor first drops into user mode, with the
+// host's side logged as for a checkpoint, and save a raw one from there
+void sim_t::boot_to_user(const std::string& snapshot)
+{
+  // runs that restore the snapshot never see the boot, so this one keeps it
+  // out of the caches, profiles and logs as well
+  std::vector<bool> histogram, commit_log, simpoint;
+  for (size_t i = 0; i < procs.size(); i++)
+  {
+    histogram.push_back(procs[i]->histogram_enabled);
+    commit_log.push_back(procs[i]->commit_log_enabled);
+    simpoint.push_back(procs[i]->simpoint_enabled);
+    procs[i]->set_histogram(false);
+    procs[i]->set_commit_log(false);
+    procs[i]->simpoint_enabled = false;
+    procs[i]->get_mmu()->pause_trace(true);
+  }
+
+  htif->start_checkpointing();
+  bool user = false;
+  while (!user && run(1))
+    for (size_t i = 0; i < procs.size(); i++)
+      user |= !(procs[i]->get_state()->sr & SR_S);
+
+  if (user)
+  {
+    std::ostringstream htif_log, regs;
+    htif->output_checkpointing(htif_log);
+    create_register_checkpoint(regs);
+    // under a name of its own until it is complete, as other runs may be
+    // booting the same program at the same time
+    std::string tmp = snapshot + "." + std::to_string(getpid());
+    if (raw_ckpt_t::write(tmp, htif_log.str(), regs.str(), target_mem.get()) &&
+        rename(tmp.c_str(), snapshot.c_str()) == 0) {
+      std::cerr << "Saved boot snapshot to " << snapshot << std::endl;
+    } else {
+      std::cerr << "warning: saving boot snapshot to " << snapshot << " failed\n";
+      unlink(tmp.c_str());
+    }
+  }
+
+  // a restored run starts its interleaving afresh
+  current_step = 0;
+  htif->stop_checkpointing();
+
+  for (size_t i = 0; i < procs.size(); i++)
+  {
+    procs[i]->set_histogram(histogram[i]);
+    procs[i]->set_commit_log(commit_log[i]);
+    procs[i]->simpoint_enabled = simpoint[i];
+    procs[i]->get_mmu()->pause_trace(false);
+  }
 }
 
 int sim_t::run()
 {
+  if (parallel_quantum)
+    start_hart_threads();
   while (htif->tick())
   {
     if (debug || ctrlc_pressed)
       interactive();
+    else if (parallel_quantum && !parallel_deterministic)
+      run_round(ALL_HARTS, parallel_quantum);
     else
       step(INTERLEAVE);
   }
+  stop_hart_threads();
   return htif->exit_code();
 }
 
@@ -104,7 +249,10 @@ void sim_t::step(size_t n)
   for (size_t i = 0, steps = 0; i < n; i += steps)
   {
     steps = std::min(n - i, INTERLEAVE - current_step);
-    procs[current_proc]->step(steps);
+    if (hart_threads.empty())
+      procs[current_proc]->step(steps);
+    else
+      run_round(current_proc, steps);
 
     current_step += steps;
     if (current_step == INTERLEAVE)
@@ -154,6 +302,86 @@ bool sim_t::run(size_t n)
   return htif_return;
 }
 
+void sim_t::set_parallel(size_t quantum, bool deterministic)
+{
+  parallel_quantum = quantum;
+  parallel_deterministic = deterministic;
+}
+
+void sim_t::start_hart_threads()
+{
+  // deterministic runs only ever have one processor going at a time
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_concurrent(!parallel_deterministic);
+
+  round_id = 0;
+  round_busy = 0;
+  rounds_over = false;
+  for (size_t i = 0; i < procs.size(); i++)
+    hart_threads.push_back(std::thread(&sim_t::hart_thread, this, i));
+}
+
+void sim_t::stop_hart_threads()
+{
+  if (hart_threads.empty())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(round_lock);
+    rounds_over = true;
+    round_id++;
+  }
+  round_start.notify_all();
+  for (size_t i = 0; i < hart_threads.size(); i++)
+    hart_threads[i].join();
+  hart_threads.clear();
+
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_concurrent(false);
+}
+
+void sim_t::run_round(size_t hart, size_t steps)
+{
+  std::unique_lock<std::mutex> lock(round_lock);
+  round_hart = hart;
+  round_steps = steps;
+  round_busy = hart == ALL_HARTS ? procs.size() : 1;
+  round_id++;
+  round_start.notify_all();
+  round_done.wait(lock, [&]{ return round_busy == 0; });
+}
+
+void sim_t::hart_thread(size_t i)
+{
+  processor_t* proc = procs[i];
+  std::unique_lock<std::mutex> lock(round_lock);
+  for (size_t seen = 0; ; seen = round_id)
+  {
+    round_start.wait(lock, [&]{ return round_id != seen; });
+    if (rounds_over)
+      return;
+    if (round_hart != ALL_HARTS && round_hart != i)
+      continue;
+
+    size_t steps = round_steps;
+    bool whole_quantum = round_hart == ALL_HARTS;
+    lock.unlock();
+    if (!whole_quantum)
+      proc->step(steps);
+    else
+    {
+      // step() returns early at a trap, so keep going until the quantum
+      // is used up. a processor that retires nothing still uses a step.
+      for (size_t done = 0; done < steps && proc->running(); )
+        done += std::max(proc->step(steps - done), size_t(1));
+    }
+    lock.lock();
+
+    if (--round_busy == 0)
+      round_done.notify_one();
+  }
+}
+
 bool sim_t::running()
 {
   for (size_t i = 0; i < procs.size(); i++)
@@ -182,23 +410,39 @@ void sim_t::set_histogram(bool value)
   }
 }
 
-#ifdef RISCV_ENABLE_SIMPOINT
+void sim_t::set_dispatch(dispatch_t value)
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->set_dispatch(value);
+  }
+}
+
+void sim_t::set_hugepages(bool value)
+{
+  if (value)
+    target_mem->advise_hugepages();
+}
+
 void sim_t::set_simpoint(bool enable, size_t interval)
 {
   for (size_t i = 0; i < procs.size(); i++) {
     procs[i]->set_simpoint(enable, interval);
   }
 }
-#endif
 
-#ifdef RISCV_ENABLE_DBG_TRACE
 void sim_t::enable_trace(size_t n)
 {
   for (size_t i = 0; i < procs.size(); i++) {
     procs[i]->enable_trace(n);
   }
 }
-#endif
+
+void sim_t::set_commit_log(bool value)
+{
+  for (size_t i = 0; i < procs.size(); i++) {
+    procs[i]->set_commit_log(value);
+  }
+}
 
 void sim_t::set_procs_debug(bool value)
 {
@@ -206,6 +450,21 @@ void sim_t::set_procs_debug(bool value)
     procs[i]->set_debug(value);
 }
 
+const decoder_t* sim_t::get_decoder(extension_t* x)
+{
+  std::unique_ptr<decoder_t>& d = decoders[x ? x->name() : ""];
+  if (!d)
+    d.reset(new decoder_t(x));
+  return d.get();
+}
+
+void sim_t::set_shared_decode(bool value)
+{
+  decode_cache.reset(value ? new decode_cache_t : NULL);
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->get_mmu()->set_decode_cache(decode_cache.get());
+}
+
 void sim_t::init_checkpoint()
 {
   checkpointing_enabled = true;
@@ -215,37 +474,168 @@ void sim_t::init_checkpoint()
 bool sim_t::create_checkpoint(std::string checkpoint_file)
 {
   bool htif_return = true;
-  // Check if file name has .gz extension. If not, append .gz to the name
-  if(checkpoint_file.substr(checkpoint_file.find_last_of(".") + 1) != "gz") {
-    checkpoint_file = checkpoint_file+".gz";
+
+  // deltas and manifests are always compressed, whatever their base is.
+  // Check if file name has the extension of its format. If not, append it
+  bool raw = checkpoint_format == CKPT_RAW && delta_base.empty() && !page_store;
+  std::string ext = raw ? "raw" : "gz";
+  if (checkpoint_file.substr(checkpoint_file.find_last_of(".") + 1) != ext)
+    checkpoint_file += "." + ext;
+
+  pid_t pid = -1;
+  if (checkpoint_jobs)
+  {
+    reap_checkpoint_writers(checkpoint_jobs - 1);
+    // the child gets none of the threads that fill memory on demand, so it
+    // has to have all of memory to begin with
+    target_mem->fill_all();
+    fflush(NULL);
+    std::cout.flush();
+    std::cerr.flush();
+    if ((pid = fork()) == 0)
+      _exit(write_checkpoint(checkpoint_file, raw) ? 0 : 1);
+    if (pid < 0)
+      perror("fork");
+    else
+      ckpt_writers.push_back(ckpt_writer_t{pid, checkpoint_file});
   }
 
+  if (pid < 0 && !write_checkpoint(checkpoint_file, raw))
+    exit(0);
+
+  if (checkpoint_delta)
+    start_delta(checkpoint_file);
+  return htif_return;
+}
+
+bool sim_t::write_checkpoint(const std::string& checkpoint_file, bool raw)
+{
+  if (raw)
+  {
+    std::ostringstream htif_log, regs;
+    htif->output_checkpointing(htif_log);
+    create_register_checkpoint(regs);
+    if (!raw_ckpt_t::write(checkpoint_file, htif_log.str(), regs.str(),
+                           target_mem.get())) {
+      std::cerr << "ERROR: Writing file `" << checkpoint_file << "' failed.\n";
+      return false;
+    }
+    std::cerr << "Created processor checkpoint to " << checkpoint_file << std::endl;
+    return true;
+  }
+
+  // the stream is reused, so a failure of the checkpoint before must not
+  // fail this one too
+  proc_chkpt.clear();
   proc_chkpt.open(checkpoint_file.c_str(), std::ios::out | std::ios::binary);
   if ( ! proc_chkpt.good()) {
     std::cerr << "ERROR: Opening file `" << checkpoint_file << "' failed.\n";
-    exit(0);
+    return false;
   }
+
+  // a short write, or a member that didn't deflate, only leaves badbit
+  // on the stream
+  auto failed = [&]() {
+    proc_chkpt.close();
+    std::cerr << "ERROR: Writing file `" << checkpoint_file << "' failed.\n";
+    return false;
+  };
+
   htif->output_checkpointing(proc_chkpt);
+  if (!proc_chkpt.good())
+    return failed();
   fprintf(stderr,"Checkpointed HTIF state\n");
   fflush(0);
 
-  create_memory_checkpoint(proc_chkpt);
+  create_memory_checkpoint(proc_chkpt, checkpoint_file);
+  if (!proc_chkpt.good())
+    return failed();
   fprintf(stderr,"Checkpointed memory state\n");
   fflush(0);
 
   create_register_checkpoint(proc_chkpt);
+  if (!proc_chkpt.good())
+    return failed();
   fprintf(stderr,"Checkpointed register state\n");
   fflush(0);
 
   proc_chkpt.close();
+  if (!proc_chkpt.good()) {
+    std::cerr << "ERROR: Writing file `" << checkpoint_file << "' failed.\n";
+    return false;
+  }
   std::cerr << "Created processor checkpoint to " << checkpoint_file << std::endl;
-  return htif_return;
+  return true;
+}
+
+// collect the writers that are done, then wait for the oldest ones until
+// no more than max_left are still going
+void sim_t::reap_checkpoint_writers(size_t max_left)
+{
+  for (size_t i = 0; i < ckpt_writers.size(); )
+  {
+    int status = 0;
+    pid_t pid = ckpt_writers[i].pid;
+    bool block = i == 0 && ckpt_writers.size() > max_left;
+    pid_t ret;
+    while ((ret = waitpid(pid, &status, block ? 0 : WNOHANG)) < 0 && errno == EINTR)
+      ;
+    if (ret == 0) {
+      i++;
+      continue;
+    }
+
+    if (ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      std::cerr << "ERROR: Writing checkpoint `" << ckpt_writers[i].file << "' failed.\n";
+      ckpt_writer_failed = true;
+    }
+    ckpt_writers.erase(ckpt_writers.begin() + i);
+    i = 0;
+  }
+}
+
+bool sim_t::wait_checkpoints()
+{
+  reap_checkpoint_writers(0);
+  return !ckpt_writer_failed;
+}
+
+void sim_t::set_lazy_restore(bool value)
+{
+  target_mem->set_lazy(value);
+}
+
+void sim_t::set_checkpoint_store(const std::string& dir)
+{
+  std::string path = dir;
+  while (path.size() > 1 && path[path.size() - 1] == '/')
+    path.erase(path.size() - 1);
+  if (!path.empty())
+    mkdir(path.c_str(), 0777);
+  page_store.reset(path.empty() ? NULL : new page_store_t(path));
+}
+
+// stores to pages already in a TLB skip the refill that would mark them
+// dirty, so those entries have to go along with the bits
+void sim_t::start_delta(const std::string& base)
+{
+  target_mem->clear_dirty();
+  debug_mmu->flush_store_tlb();
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->get_mmu()->flush_store_tlb();
+  delta_base = base;
 }
 
 bool sim_t::restore_checkpoint(std::string restore_file)
 {
   bool htif_return = true;
 
+  // raw checkpoints are told apart by their contents
+  if (raw_ckpt_t::is_raw(restore_file + ".raw"))
+    restore_file += ".raw";
+  if (raw_ckpt_t::is_raw(restore_file))
+    return restore_raw_checkpoint(restore_file);
+
   // Check if file name has .gz extension. If not, append .gz to the name
   if(restore_file.substr(restore_file.find_last_of(".") + 1) != "gz") {
     restore_file = restore_file+".gz";
@@ -264,7 +654,7 @@ bool sim_t::restore_checkpoint(std::string restore_file)
   std::cerr << "Done restoring HTIF checkpoint from " << restore_file << std::endl;
 
   //std::cerr << "Trying to restore mem/reg HTIF checkpoint from " << restore_file << std::endl;
-  restore_memory_checkpoint(restore_chkpt);
+  restore_memory_checkpoint(restore_chkpt, restore_file);
   restore_proc_checkpoint(restore_chkpt);
   restore_chkpt.close();
   std::cerr << "Done restoring mem/reg checkpoint from " << restore_file << std::endl;
@@ -272,12 +662,176 @@ bool sim_t::restore_checkpoint(std::string restore_file)
   return htif_return;
 }
 
-void sim_t::create_memory_checkpoint(std::ostream& memory_chkpt)
+bool sim_t::restore_raw_checkpoint(const std::string& restore_file)
+{
+  raw_ckpt_t ckpt;
+  if (!ckpt.open(restore_file)) {
+    std::cerr << "ERROR: Reading file `" << restore_file << "' failed.\n";
+    return false;
+  }
+
+  std::istringstream htif_log(ckpt.htif());
+  bool htif_return = htif->restore_checkpoint(htif_log);
+  std::cerr << "Done restoring HTIF checkpoint from " << restore_file << std::endl;
+
+  if (!ckpt.map_memory(target_mem.get()))
+    exit(-1);
+  std::istringstream regs(ckpt.regs());
+  restore_proc_checkpoint(regs);
+  std::cerr << "Done restoring mem/reg checkpoint from " << restore_file << std::endl;
+
+  return htif_return;
+}
+
+// a dense memory checkpoint is the signature, the memory size and then
+// all of memory. a sparse one is the signature, the memory size, the page
+// size, the number of pages present and their page numbers in ascending
+// order, followed by the contents of those pages. the rest is zero. a
+// delta is laid out like a sparse one, except that the length and name of
+// the checkpoint it is based on come before the page numbers, and the
+// pages listed are the ones that changed since; the rest is as in the base.
+// a manifest starts like a sparse one too, followed by the length and name
+// of its page store, and then holds the number and the hash of each page
+// that is not zero, in place of the pages themselves.
+static const uint64_t DENSE_MEM_CKPT_SIGNATURE = 0xbaadbeefdeadbeef;
+static const uint64_t SPARSE_MEM_CKPT_SIGNATURE = 0xbaadbeef5ba45e01;
+static const uint64_t DELTA_MEM_CKPT_SIGNATURE = 0xbaadbeefde17a001;
+static const uint64_t MANIFEST_MEM_CKPT_SIGNATURE = 0xbaadbeef3a41f357;
+
+static bool is_memory_checkpoint(uint64_t signature)
+{
+  return signature == DENSE_MEM_CKPT_SIGNATURE ||
+         signature == SPARSE_MEM_CKPT_SIGNATURE ||
+         signature == DELTA_MEM_CKPT_SIGNATURE ||
+         signature == MANIFEST_MEM_CKPT_SIGNATURE;
+}
+
+// a checkpoint names the files it depends on, its base or its page store,
+// relative to its own directory, so that they can be moved together
+static std::string ckpt_dir(const std::string& file)
 {
-  uint64_t signature = 0xbaadbeefdeadbeef;
-  memory_chkpt.write((char*)&signature,8);
-  memory_chkpt.write((char*)&memsz,sizeof(memsz));
-  memory_chkpt.write(mem,memsz);
+  size_t slash = file.find_last_of('/');
+  return slash == std::string::npos ? "" : file.substr(0, slash + 1);
+}
+
+static std::vector<std::string> path_components(const char* path)
+{
+  std::vector<std::string> parts;
+  std::istringstream in(path);
+  std::string part;
+  while (std::getline(in, part, '/'))
+    if (!part.empty())
+      parts.push_back(part);
+  return parts;
+}
+
+static std::string ckpt_base_name(const std::string& file, const std::string& base)
+{
+  if (ckpt_dir(base) == ckpt_dir(file))
+    return base.substr(ckpt_dir(base).size());
+
+  std::string dir = ckpt_dir(file);
+  char* from = realpath(dir.empty() ? "." : dir.c_str(), NULL);
+  char* to = realpath(base.c_str(), NULL);
+  std::string name = to ? to : base;
+  if (from && to)
+  {
+    std::vector<std::string> f = path_components(from), t = path_components(to);
+    size_t common = 0;
+    while (common < f.size() && common < t.size() && f[common] == t[common])
+      common++;
+    name.clear();
+    for (size_t i = common; i < f.size(); i++)
+      name += "../";
+    for (size_t i = common; i < t.size(); i++)
+      name += t[i] + (i + 1 < t.size() ? "/" : "");
+  }
+  free(from);
+  free(to);
+  return name;
+}
+
+static std::string ckpt_base_path(const std::string& file, const std::string& name)
+{
+  return name[0] == '/' ? name : ckpt_dir(file) + name;
+}
+
+void sim_t::create_memory_checkpoint(std::ostream& memory_chkpt,
+                                     const std::string& chkpt_file)
+{
+  if (page_store)
+  {
+    std::string store = ckpt_base_name(chkpt_file, page_store->path());
+    uint64_t pgsize = target_mem->page_size();
+    std::vector<uint64_t> entries;
+    for (uint64_t page = 0; page < memsz / pgsize; page++)
+    {
+      char* data = mem + page * pgsize;
+      if (!target_mem->page_written(page * pgsize) ||
+          target_mem_t::is_zero(data, pgsize))
+        continue;
+      page_store_t::hash_t h = page_store_t::hash(data, pgsize);
+      if (!page_store->put(h, data, pgsize))
+      {
+        fprintf(stderr, "ERROR: Adding a page to `%s' failed.\n",
+                page_store->path().c_str());
+        exit(-1);
+      }
+      entries.push_back(page);
+      entries.push_back(h.lo);
+      entries.push_back(h.hi);
+    }
+
+    uint64_t header[5] = {MANIFEST_MEM_CKPT_SIGNATURE, memsz, pgsize,
+                          entries.size() / 3, store.size()};
+    memory_chkpt.write((char*)header, sizeof(header));
+    memory_chkpt.write(store.data(), store.size());
+    memory_chkpt.write((char*)entries.data(), entries.size() * sizeof(uint64_t));
+    return;
+  }
+
+  if (!delta_base.empty())
+  {
+    // a page that went back to zero still has to be listed
+    std::string base = ckpt_base_name(chkpt_file, delta_base);
+    uint64_t pgsize = target_mem->page_size();
+    std::vector<uint64_t> pages;
+    for (uint64_t page = 0; page < memsz / pgsize; page++)
+      if (target_mem->page_dirty(page * pgsize))
+        pages.push_back(page);
+
+    uint64_t header[5] = {DELTA_MEM_CKPT_SIGNATURE, memsz, pgsize,
+                          pages.size(), base.size()};
+    memory_chkpt.write((char*)header, sizeof(header));
+    memory_chkpt.write(base.data(), base.size());
+    memory_chkpt.write((char*)pages.data(), pages.size() * sizeof(uint64_t));
+    for (size_t i = 0; i < pages.size(); i++)
+      memory_chkpt.write(mem + pages[i] * pgsize, pgsize);
+    return;
+  }
+
+  if (checkpoint_format == CKPT_DENSE)
+  {
+    uint64_t signature = DENSE_MEM_CKPT_SIGNATURE;
+    memory_chkpt.write((char*)&signature,8);
+    memory_chkpt.write((char*)&memsz,sizeof(memsz));
+    memory_chkpt.write(mem,memsz);
+    return;
+  }
+
+  // pages that were never written are zero without having to look
+  uint64_t pgsize = target_mem->page_size();
+  std::vector<uint64_t> pages;
+  for (uint64_t page = 0; page < memsz / pgsize; page++)
+    if (target_mem->page_written(page * pgsize) &&
+        !target_mem->page_is_zero(page * pgsize))
+      pages.push_back(page);
+
+  uint64_t header[4] = {SPARSE_MEM_CKPT_SIGNATURE, memsz, pgsize, pages.size()};
+  memory_chkpt.write((char*)header, sizeof(header));
+  memory_chkpt.write((char*)pages.data(), pages.size() * sizeof(uint64_t));
+  for (size_t i = 0; i < pages.size(); i++)
+    memory_chkpt.write(mem + pages[i] * pgsize, pgsize);
 }
 
 void sim_t::create_register_checkpoint(std::ostream& proc_chkpt)
@@ -288,16 +842,157 @@ void sim_t::create_register_checkpoint(std::ostream& proc_chkpt)
   proc_chkpt.write((char *)state,sizeof(state_t));
 }
 
-void sim_t::restore_memory_checkpoint(std::istream& memory_chkpt)
+void sim_t::restore_memory_checkpoint(std::istream& memory_chkpt,
+                                      const std::string& chkpt_file)
 {
   uint64_t signature;
   uint64_t chkpt_memsz;
   memory_chkpt.read((char*)&signature,8);
-  assert(signature == 0xbaadbeefdeadbeef);
-  // Check that the checkpointed memory size the current simulator memory size are same
+  assert(is_memory_checkpoint(signature));
   memory_chkpt.read((char*)&chkpt_memsz,sizeof(chkpt_memsz));
-  assert(memsz == chkpt_memsz);
-  memory_chkpt.read(mem,memsz);
+  load_memory_checkpoint(memory_chkpt, signature, chkpt_memsz,
+                         target_mem.get(), chkpt_file);
+}
+
+// restore just the memory of a checkpoint, which may itself be a delta
+bool sim_t::load_memory_checkpoint_file(const std::string& chkpt_file,
+                                        target_mem_t* target_mem)
+{
+  if (raw_ckpt_t::is_raw(chkpt_file))
+  {
+    raw_ckpt_t ckpt;
+    return ckpt.open(chkpt_file) && ckpt.map_memory(target_mem);
+  }
+
+  ipgzstream in;
+  in.open(chkpt_file.c_str(), std::ios::in | std::ios::binary);
+  std::string htif_log;
+  uint64_t signature, chkpt_memsz;
+  if (!in.good() || !htif_isasim_t::read_checkpoint(in, htif_log))
+    return false;
+  in.read((char*)&signature, 8);
+  in.read((char*)&chkpt_memsz, sizeof(chkpt_memsz));
+  if (!in.good() || !is_memory_checkpoint(signature))
+    return false;
+  load_memory_checkpoint(in, signature, chkpt_memsz, target_mem, chkpt_file);
+  return true;
+}
+
+void sim_t::load_memory_checkpoint(std::istream& memory_chkpt,
+                                   uint64_t signature, uint64_t chkpt_memsz,
+                                   target_mem_t* target_mem,
+                                   const std::string& chkpt_file)
+{
+  char* mem = target_mem->data();
+  size_t memsz = target_mem->size();
+
+  // memory the checkpoint does not cover ends up zero, whatever was
+  // loaded into it before. a delta leaves that to its base, and a lazily
+  // restored manifest throws all of memory away.
+  size_t pgsize = target_mem->page_size();
+  bool lazy = signature == MANIFEST_MEM_CKPT_SIGNATURE && target_mem->is_lazy();
+  if (signature != DELTA_MEM_CKPT_SIGNATURE && !lazy)
+    for (size_t paddr = 0; paddr < memsz; paddr += pgsize)
+      if (target_mem->page_written(paddr))
+        memset(mem + paddr, 0, pgsize);
+
+  if (signature == DENSE_MEM_CKPT_SIGNATURE)
+  {
+    // a smaller memory than the checkpoint's only works out if the part
+    // that does not fit is zero
+    std::vector<char> page(pgsize);
+    for (uint64_t paddr = 0; paddr < chkpt_memsz; paddr += pgsize)
+    {
+      size_t len = std::min<uint64_t>(pgsize, chkpt_memsz - paddr);
+      memory_chkpt.read(page.data(), len);
+      if (target_mem_t::is_zero(page.data(), len))
+        continue;
+      if (paddr + len > memsz)
+      {
+        fprintf(stderr, "Checkpoint uses memory beyond 0x%lx; increase -m\n",
+                (unsigned long)memsz);
+        exit(-1);
+      }
+      memcpy(mem + paddr, page.data(), len);
+      target_mem->mark_written(paddr);
+    }
+    return;
+  }
+
+  uint64_t chkpt_pgsize, npages;
+  memory_chkpt.read((char*)&chkpt_pgsize,sizeof(chkpt_pgsize));
+  memory_chkpt.read((char*)&npages,sizeof(npages));
+  if (signature == MANIFEST_MEM_CKPT_SIGNATURE)
+  {
+    uint64_t len;
+    memory_chkpt.read((char*)&len,sizeof(len));
+    std::string name(len, 0);
+    memory_chkpt.read(&name[0], len);
+    page_store_t store(ckpt_base_path(chkpt_file, name));
+    std::vector<target_mem_t::page_source_t> sources;
+    for (size_t i = 0; i < npages; i++)
+    {
+      uint64_t entry[3];
+      memory_chkpt.read((char*)entry, sizeof(entry));
+      uint64_t paddr = entry[0] * chkpt_pgsize;
+      if (paddr + chkpt_pgsize > memsz)
+      {
+        fprintf(stderr, "Checkpoint uses memory beyond 0x%lx; increase -m\n",
+                (unsigned long)memsz);
+        exit(-1);
+      }
+      page_store_t::hash_t h = {entry[1], entry[2]};
+      if (lazy)
+      {
+        for (uint64_t off = 0; off < chkpt_pgsize; off += pgsize)
+          sources.push_back(target_mem_t::page_source_t{paddr + off,
+                                                        store.file(h), off_t(off)});
+        continue;
+      }
+      if (!store.get(h, mem + paddr, chkpt_pgsize))
+      {
+        fprintf(stderr, "Page %016llx%016llx of %s is missing from %s\n",
+                (unsigned long long)entry[2], (unsigned long long)entry[1],
+                chkpt_file.c_str(), store.path().c_str());
+        exit(-1);
+      }
+      for (uint64_t off = 0; off < chkpt_pgsize; off += pgsize)
+        target_mem->mark_written(paddr + off);
+    }
+    if (lazy)
+      target_mem->fill_on_demand(sources);
+    return;
+  }
+
+  if (signature == DELTA_MEM_CKPT_SIGNATURE)
+  {
+    uint64_t len;
+    memory_chkpt.read((char*)&len,sizeof(len));
+    std::string base(len, 0);
+    memory_chkpt.read(&base[0], len);
+    base = ckpt_base_path(chkpt_file, base);
+    if (!load_memory_checkpoint_file(base, target_mem))
+    {
+      fprintf(stderr, "Cannot restore %s, the base of %s\n",
+              base.c_str(), chkpt_file.c_str());
+      exit(-1);
+    }
+  }
+  std::vector<uint64_t> pages(npages);
+  memory_chkpt.read((char*)pages.data(), npages * sizeof(uint64_t));
+  for (size_t i = 0; i < npages; i++)
+  {
+    uint64_t paddr = pages[i] * chkpt_pgsize;
+    if (paddr + chkpt_pgsize > memsz)
+    {
+      fprintf(stderr, "Checkpoint uses memory beyond 0x%lx; increase -m\n",
+              (unsigned long)memsz);
+      exit(-1);
+    }
+    memory_chkpt.read(mem + paddr, chkpt_pgsize);
+    for (uint64_t off = 0; off < chkpt_pgsize; off += pgsize)
+      target_mem->mark_written(paddr + off);
+  }
 }
 
 void sim_t::restore_proc_checkpoint(std::istream& proc_chkpt)
@@ -307,4 +1002,36 @@ void sim_t::restore_proc_checkpoint(std::istream& proc_chkpt)
   proc_chkpt.read((char*)&signature,8);
   assert(signature == 0xdeadbeefbaadbeeful);
   proc_chkpt.read((char *)state,sizeof(state_t));
+
+  // the TLB and decoded instructions were filled under the old state,
+  // and the shared ones from the old memory
+  procs[0]->get_mmu()->flush_tlb();
+  if (decode_cache)
+    decode_cache->flush();
+  procs[0]->set_pcr(CSR_STATUS, state->sr);
+}
+
+bool sim_t::convert_checkpoint(const std::string& from, const std::string& to)
+{
+  ipgzstream in;
+  in.open(from.c_str(), std::ios::in | std::ios::binary);
+  if (!in.good())
+    return false;
+
+  std::string htif_log;
+  if (!htif_isasim_t::read_checkpoint(in, htif_log))
+    return false;
+
+  uint64_t signature, chkpt_memsz;
+  in.read((char*)&signature, 8);
+  in.read((char*)&chkpt_memsz, sizeof(chkpt_memsz));
+  if (!in.good() || !is_memory_checkpoint(signature))
+    return false;
+
+  target_mem_t mem(chkpt_memsz, PGSIZE);
+  load_memory_checkpoint(in, signature, chkpt_memsz, &mem, from);
+
+  std::string regs(8 + sizeof(state_t), 0);
+  in.read(&regs[0], regs.size());
+  return in.good() && raw_ckpt_t::write(to, htif_log, regs, &mem);
 }
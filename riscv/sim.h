@@ -6,10 +6,16 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <map>
 #include <fstream>
-#include <gzstream.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+#include "pgzstream.h"
 #include "processor.h"
 #include "mmu.h"
+#include "target_mem.h"
 
 // ifprintf macro definition.
 #define ifprintf(condition, file, args...){	\
@@ -19,6 +25,17 @@
   }
 
 class htif_isasim_t;
+class page_store_t;
+class decoder_t;
+class decode_cache_t;
+
+// how create_checkpoint stores memory. restore_checkpoint reads either.
+enum ckpt_format_t
+{
+  CKPT_DENSE, // every byte of memory, as older simulators expect
+  CKPT_SPARSE, // an index of the pages that are not zero, then just those
+  CKPT_RAW, // uncompressed, for restoring by mapping memory (raw_ckpt.h)
+};
 
 // this class encapsulates the processors and memory in a RISC-V machine.
 class sim_t
@@ -29,22 +46,43 @@ public:
 
   // run the simulation to completion
   void boot();
+  // have boot() start from a snapshot of the machine as it first enters
+  // user mode, kept in dir for each program, argument list and machine
+  // size. the first boot of each runs up to there to take it.
+  void set_boot_cache(const std::string& dir);
   int run();
   bool run(size_t n);
   bool running();
   void stop();
   void set_debug(bool value);
   void set_histogram(bool value);
+  void set_dispatch(dispatch_t value);
+  void set_hugepages(bool value);
   void set_procs_debug(bool value);
   htif_isasim_t* get_htif() { return htif.get(); }
+  // give a forked copy of the simulator a host of its own, which then has
+  // to boot it again. the one it was forked with stays with the parent.
+  // a simulator made without host arguments has no host until given one
+  // here, with the arguments it is to run.
+  void reconnect_host();
+  void reconnect_host(const std::vector<std::string>& args);
 
-#ifdef RISCV_ENABLE_SIMPOINT
   void set_simpoint(bool enable, size_t interval);
-#endif
-
-#ifdef RISCV_ENABLE_DBG_TRACE
   void enable_trace(size_t n);
-#endif
+  void set_commit_log(bool value);
+
+  // have run() step each processor on a host thread of its own. they run
+  // side by side for quantum instructions at a time, stopping together for
+  // every HTIF tick. with deterministic set they instead take turns, in
+  // exactly the order the single-threaded loop would run them.
+  void set_parallel(size_t quantum, bool deterministic);
+
+  // the decoder for processors with extension x, or with none for NULL;
+  // there is one per extension, built the first time it is asked for
+  const decoder_t* get_decoder(extension_t* x);
+  // have the processors share the instructions they decode, by physical
+  // address, besides keeping those they run most recently to themselves
+  void set_shared_decode(bool value);
 
   // deliver an IPI to a specific processor
   void send_ipi(reg_t who);
@@ -54,18 +92,41 @@ public:
   processor_t* get_core(size_t i) { return procs.at(i); }
 
   void init_checkpoint();
+  void set_checkpoint_format(ckpt_format_t value) { checkpoint_format = value; }
+  // write each checkpoint after the first as the pages stored to since the
+  // one before, which restore then has to find next to it
+  void set_checkpoint_delta(bool value) { checkpoint_delta = value; }
+  // keep the memory of checkpoints in a page store shared with others, and
+  // just a manifest of its pages in each checkpoint
+  void set_checkpoint_store(const std::string& dir);
+  // write checkpoints from forked copies of the simulator, up to jobs of
+  // them at a time, while it runs on. with 0 create_checkpoint writes them.
+  void set_checkpoint_jobs(size_t jobs) { checkpoint_jobs = jobs; }
   bool create_checkpoint(std::string checkpoint_file);
+  // wait for the checkpoints still being written, and report whether all
+  // of them were
+  bool wait_checkpoints();
   bool restore_checkpoint(std::string restore_file);
+  // read the pages of checkpoints that keep them in a page store only as
+  // the target first touches them. raw checkpoints are always mapped.
+  void set_lazy_restore(bool value);
+
+  // rewrite a compressed checkpoint as a raw one
+  static bool convert_checkpoint(const std::string& from, const std::string& to);
 
   // read one of the system control registers
   reg_t get_scr(int which);
 
 private:
+  std::vector<std::string> htif_args;
   std::unique_ptr<htif_isasim_t> htif;
+  std::unique_ptr<target_mem_t> target_mem;
   char* mem; // main memory
   size_t memsz; // memory size in bytes
   mmu_t* debug_mmu;  // debug port into main memory
   std::vector<processor_t*> procs;
+  std::map<std::string, std::unique_ptr<decoder_t>> decoders; // by extension
+  std::unique_ptr<decode_cache_t> decode_cache;
 
   void step(size_t n); // step through simulation
   static const size_t INTERLEAVE = 5000;
@@ -74,6 +135,45 @@ private:
   bool debug;
   bool histogram_enabled; // provide a histogram of PCs
   bool checkpointing_enabled;
+  ckpt_format_t checkpoint_format;
+  bool checkpoint_delta;
+  std::string delta_base; // the last checkpoint, once there is one
+  std::unique_ptr<page_store_t> page_store;
+  std::string boot_cache;
+  std::string boot_snapshot_name();
+  void boot_to_user(const std::string& snapshot);
+  void start_delta(const std::string& base);
+  bool write_checkpoint(const std::string& checkpoint_file, bool raw);
+
+  // forked processes writing checkpoints, oldest first
+  struct ckpt_writer_t
+  {
+    pid_t pid;
+    std::string file;
+  };
+  size_t checkpoint_jobs;
+  std::vector<ckpt_writer_t> ckpt_writers;
+  bool ckpt_writer_failed;
+  void reap_checkpoint_writers(size_t max_left);
+
+  // host threads of a parallel run. the thread calling run() hands them
+  // rounds of work: all of them for a quantum, or one for a step() slice.
+  size_t parallel_quantum; // 0 runs every processor on the calling thread
+  bool parallel_deterministic;
+  std::vector<std::thread> hart_threads;
+  std::mutex round_lock;
+  std::condition_variable round_start;
+  std::condition_variable round_done;
+  size_t round_id;
+  size_t round_hart; // or ALL_HARTS
+  size_t round_steps;
+  size_t round_busy; // threads still working on the round
+  bool rounds_over;
+  static const size_t ALL_HARTS = -1;
+  void start_hart_threads();
+  void stop_hart_threads();
+  void hart_thread(size_t i);
+  void run_round(size_t hart, size_t steps);
 
   // presents a prompt for introspection into the simulation
   void interactive();
@@ -101,10 +201,19 @@ private:
 
   //std::fstream proc_chkpt;
   //std::fstream restore_chkpt;
-  ogzstream proc_chkpt;
-  igzstream restore_chkpt;
-  void create_memory_checkpoint(std::ostream& memory_chkpt);
-  void restore_memory_checkpoint(std::istream& memory_chkpt);
+  opgzstream proc_chkpt;
+  ipgzstream restore_chkpt;
+  void create_memory_checkpoint(std::ostream& memory_chkpt,
+                                const std::string& chkpt_file);
+  void restore_memory_checkpoint(std::istream& memory_chkpt,
+                                 const std::string& chkpt_file);
+  static void load_memory_checkpoint(std::istream& memory_chkpt,
+                                     uint64_t signature, uint64_t chkpt_memsz,
+                                     target_mem_t* target_mem,
+                                     const std::string& chkpt_file);
+  static bool load_memory_checkpoint_file(const std::string& chkpt_file,
+                                          target_mem_t* target_mem);
+  bool restore_raw_checkpoint(const std::string& restore_file);
   void create_register_checkpoint(std::ostream& proc_chkpt);
   void restore_proc_checkpoint(std::istream& proc_chkpt);
 
@@ -0,0 +1,405 @@
+// See LICENSE for license details.
+
+#include "slice_runner.h"
+#include "sim.h"
+#include "htif.h"
+#include "bbtracker.h"
+#include "debug_tracer.h"
+#include "pgzstream.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+slice_runner_t::slice_runner_t(sim_t* sim, const std::vector<memtracer_t*>& tracers,
+                               const std::vector<cache_sim_t*>& caches)
+  : sim(sim), tracers(tracers), caches(caches), trace(false), simpoint(false),
+    simpoint_interval(0), host_base(0)
+{
+}
+
+void slice_runner_t::set_simpoint(bool enable, size_t interval)
+{
+  simpoint = enable;
+  simpoint_interval = interval;
+}
+
+static bool read_all(int fd, void* buf, size_t len)
+{
+  for (size_t done = 0; done < len; )
+  {
+    ssize_t n = read(fd, (char*)buf + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void* buf, size_t len)
+{
+  for (size_t done = 0; done < len; )
+  {
+    ssize_t n = write(fd, (const char*)buf + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+std::string slice_runner_t::slice_dir(size_t slice)
+{
+  return dir + "/" + std::to_string(slice);
+}
+
+bool slice_runner_t::run(size_t len, size_t warmup, size_t jobs, size_t limit)
+{
+  len = std::max(len, size_t(1));
+  jobs = std::max(jobs, size_t(1));
+  dir = "slices_" + std::to_string(getpid());
+  mkdir(dir.c_str(), 0777);
+  signal(SIGPIPE, SIG_IGN);
+
+  chunks.clear();
+  host_log.clear();
+  host_base = 0;
+  results.clear();
+  sim->get_htif()->record_host(&host_log);
+
+  // the leader runs up to each point where a slice's warmup starts, its
+  // measured part starts, or it ends, so that a follower can split the
+  // same stretch the same way and have HTIF tick where the leader did
+  uint64_t pos = 0;
+  size_t forked = 0;
+  bool running = true;
+  for (;;)
+  {
+    while (running && (!limit || forked * len < limit))
+    {
+      uint64_t start = uint64_t(forked) * len;
+      uint64_t warm = std::min<uint64_t>(start, warmup);
+      if (start - warm != pos)
+        break;
+      fork_follower(forked++, len, warm);
+    }
+
+    bool over = !running || (limit && pos >= limit);
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < followers.size(); i++)
+      if (!followers[i].sent && (over || (followers[i].slice + 1) * len <= pos))
+        ready.push_back(followers[i].slice);
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+      for (;;)
+      {
+        size_t busy = 0;
+        for (size_t j = 0; j < followers.size(); j++)
+          busy += followers[j].sent;
+        if (busy < jobs)
+          break;
+        wait_follower();
+      }
+      for (size_t j = 0; j < followers.size(); j++)
+        if (followers[j].slice == ready[i])
+          send(followers[j]);
+    }
+    if (over)
+      break;
+
+    uint64_t next = limit ? limit : UINT64_MAX;
+    if (!limit || forked * len < limit)
+    {
+      uint64_t start = uint64_t(forked) * len;
+      next = std::min(next, start - std::min<uint64_t>(start, warmup));
+    }
+    for (size_t i = 0; i < followers.size(); i++)
+    {
+      if (followers[i].sent)
+        continue;
+      uint64_t start = uint64_t(followers[i].slice) * len;
+      if (start > pos)
+        next = std::min(next, start);
+      next = std::min(next, start + len);
+    }
+
+    running = sim->run(next - pos);
+    chunks.push_back(next - pos);
+    pos = next;
+  }
+
+  sim->get_htif()->record_host(NULL);
+  while (!followers.empty())
+    wait_follower();
+  stitch(forked);
+
+  bool ok = true;
+  for (size_t i = 0; i < results.size(); i++)
+    ok &= results[i].ok;
+  return ok;
+}
+
+void slice_runner_t::fork_follower(size_t slice, size_t len, size_t warmup)
+{
+  results.resize(slice + 1, result_t{false, 0, {}});
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    perror("socketpair");
+    return;
+  }
+  mkdir(slice_dir(slice).c_str(), 0777);
+
+  fflush(NULL);
+  std::cout.flush();
+  std::cerr.flush();
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    for (size_t i = 0; i < followers.size(); i++)
+      close(followers[i].fd);
+    if (chdir(slice_dir(slice).c_str()) != 0)
+      _exit(1);
+    follow(warmup, uint64_t(slice) * len, fds[1]);
+  }
+  close(fds[1]);
+  if (pid < 0) {
+    perror("fork");
+    close(fds[0]);
+    return;
+  }
+  followers.push_back(follower_t{pid, fds[0], slice, chunks.size(),
+                                 host_base + host_log.size(), false});
+}
+
+void slice_runner_t::send(follower_t& f)
+{
+  std::vector<uint64_t> run(chunks.begin() + f.first_chunk, chunks.end());
+  const char* host = host_log.data() + (f.host_start - host_base);
+  uint64_t header[2] = {run.size(), host_base + host_log.size() - f.host_start};
+  // one that has died already is told about by wait_follower
+  if (write_all(f.fd, header, sizeof(header)) &&
+      write_all(f.fd, run.data(), run.size() * sizeof(run[0])))
+    write_all(f.fd, host, header[1]);
+  f.sent = true;
+
+  uint64_t keep = host_base + host_log.size();
+  for (size_t i = 0; i < followers.size(); i++)
+    if (!followers[i].sent)
+      keep = std::min(keep, followers[i].host_start);
+  host_log.erase(0, keep - host_base);
+  host_base = keep;
+}
+
+void slice_runner_t::wait_follower()
+{
+  int status = 0;
+  pid_t pid = waitpid(-1, &status, 0);
+  if (pid < 0 && errno == EINTR)
+    return;
+
+  for (size_t i = 0; i < followers.size(); i++)
+  {
+    if (pid >= 0 && followers[i].pid != pid)
+      continue;
+    result_t& result = results[followers[i].slice];
+    result.caches.resize(caches.size());
+    result.ok = pid >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+                read_all(followers[i].fd, &result.instret, sizeof(result.instret)) &&
+                read_all(followers[i].fd, result.caches.data(),
+                         result.caches.size() * sizeof(result.caches[0]));
+    if (!result.ok)
+      fprintf(stderr, "ERROR: Slice %lu failed.\n", (unsigned long)followers[i].slice);
+    close(followers[i].fd);
+    followers.erase(followers.begin() + i);
+    return;
+  }
+}
+
+// runs in the follower, in its slice's directory, and never returns. start
+// is how far into the run the slice starts.
+void slice_runner_t::follow(size_t warmup, uint64_t start, int fd)
+{
+  uint64_t header[2];
+  if (!read_all(fd, header, sizeof(header)))
+    _exit(1);
+  std::vector<uint64_t> run(header[0]);
+  std::string host(header[1], 0);
+  if (!read_all(fd, run.data(), run.size() * sizeof(run[0])) ||
+      !read_all(fd, &host[0], host.size()))
+    _exit(1);
+
+  sim->get_htif()->record_host(NULL);
+  sim->get_htif()->replay_host(host);
+  for (size_t i = 0; i < sim->num_cores(); i++)
+    for (size_t j = 0; j < tracers.size(); j++)
+      sim->get_core(i)->get_mmu()->register_memtracer(tracers[j]);
+
+  // counting starts where the warmup ends, which the leader stopped at
+  uint64_t instret = 0, done = 0;
+  std::vector<cache_sim_t::stats_t> stats(caches.size());
+  bool running = true, measuring = false;
+  for (size_t i = 0; running && i <= run.size(); i++)
+  {
+    if (done == warmup && !measuring)
+    {
+      measuring = true;
+      for (size_t j = 0; j < sim->num_cores(); j++)
+        instret -= sim->get_core(j)->get_state()->count;
+      for (size_t j = 0; j < caches.size(); j++)
+        stats[j] = caches[j]->get_stats();
+      if (trace)
+        sim->enable_trace(0);
+      for (size_t j = 0; trace && j < sim->num_cores(); j++)
+        sim->get_core(j)->get_dbg_tracer()->set_seqno(start);
+      if (simpoint)
+        sim->set_simpoint(true, simpoint_interval);
+    }
+    if (i < run.size())
+    {
+      running = sim->run(run[i]);
+      done += run[i];
+    }
+  }
+
+  if (measuring)
+  {
+    for (size_t j = 0; j < sim->num_cores(); j++)
+      instret += sim->get_core(j)->get_state()->count;
+    for (size_t j = 0; j < caches.size(); j++)
+    {
+      cache_sim_t::stats_t now = caches[j]->get_stats();
+      stats[j] = now -= stats[j];
+    }
+  }
+  else
+    stats.assign(caches.size(), cache_sim_t::stats_t());
+
+  // basic block ids are the follower's own, so the leader gets the block
+  // each stands for
+  for (size_t i = 0; i < sim->num_cores(); i++)
+  {
+    processor_t* proc = sim->get_core(i);
+    if (proc->get_simpoint())
+    {
+      std::ofstream out("bbpcs_proc_" + std::to_string(i));
+      std::vector<uint64_t> pcs = proc->get_bbt()->get_pcs();
+      for (size_t j = 0; j < pcs.size(); j++)
+        out << pcs[j] << "\n";
+    }
+    proc->close_outputs();
+  }
+
+  bool ok = write_all(fd, &instret, sizeof(instret)) &&
+            write_all(fd, stats.data(), stats.size() * sizeof(stats[0]));
+  fflush(NULL);
+  _exit(ok ? 0 : 1);
+}
+
+static void append_file(const std::string& from, std::ofstream& to)
+{
+  std::ifstream in(from.c_str(), std::ios::binary);
+  if (in.good())
+    to << in.rdbuf();
+}
+
+// renumber the blocks in the rows of each slice's vectors in the order
+// they are first seen over the whole run, as one tracker would have
+static void stitch_bbv(const std::string& name, const std::vector<std::string>& dirs,
+                       size_t proc)
+{
+  std::unordered_map<uint64_t, uint64_t> ids;
+  opgzstream out;
+  out.open(name.c_str());
+  for (size_t i = 0; i < dirs.size(); i++)
+  {
+    std::vector<uint64_t> pcs;
+    std::ifstream pcs_in(dirs[i] + "/bbpcs_proc_" + std::to_string(proc));
+    for (uint64_t pc; pcs_in >> pc; )
+      pcs.push_back(pc);
+
+    ipgzstream in;
+    in.open((dirs[i] + "/" + name).c_str());
+    std::string line;
+    while (std::getline(in, line))
+    {
+      std::istringstream row(line);
+      std::vector<std::pair<uint64_t, uint64_t>> counts;
+      char c;
+      uint64_t id, count;
+      row >> c;
+      while (row >> c >> id >> c >> count)
+      {
+        if (id == 0 || id > pcs.size())
+          continue;
+        auto it = ids.insert(std::make_pair(pcs[id - 1], ids.size() + 1)).first;
+        counts.push_back(std::make_pair(it->second, count));
+      }
+      std::sort(counts.begin(), counts.end());
+      out << "T";
+      for (size_t j = 0; j < counts.size(); j++)
+        out << ":" << counts[j].first << ":" << counts[j].second << "   ";
+      out << "\n";
+    }
+  }
+  out.close();
+}
+
+// what the followers wrote goes where a single run would have put it. the
+// compressed outputs are runs of gzip members, so they simply append.
+void slice_runner_t::stitch(size_t nslices)
+{
+  std::vector<std::string> dirs;
+  for (size_t i = 0; i < nslices; i++)
+    dirs.push_back(slice_dir(i));
+
+  std::vector<std::string> names;
+  for (size_t i = 0; i < dirs.size(); i++)
+  {
+    DIR* d = opendir(dirs[i].c_str());
+    for (dirent* e; d && (e = readdir(d)); )
+      if (e->d_name[0] != '.' && std::find(names.begin(), names.end(), e->d_name) == names.end())
+        names.push_back(e->d_name);
+    if (d)
+      closedir(d);
+  }
+
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    const std::string& name = names[i];
+    size_t proc;
+    if (sscanf(name.c_str(), "bbv_proc_%zu.bb.gz", &proc) == 1)
+      stitch_bbv(name, dirs, proc);
+    else if (name.compare(0, 11, "bbpcs_proc_") != 0)
+    {
+      std::ofstream out(name.c_str(), std::ios::binary);
+      for (size_t j = 0; j < dirs.size(); j++)
+        append_file(dirs[j] + "/" + name, out);
+    }
+  }
+
+  for (size_t i = 0; i < dirs.size(); i++)
+  {
+    for (size_t j = 0; j < names.size(); j++)
+      unlink((dirs[i] + "/" + names[j]).c_str());
+    rmdir(dirs[i].c_str());
+  }
+  rmdir(dir.c_str());
+
+  for (size_t i = 0; i < results.size(); i++)
+    if (results[i].ok)
+      for (size_t j = 0; j < caches.size(); j++)
+        caches[j]->add_stats(results[i].caches[j]);
+}
@@ -0,0 +1,82 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_SLICE_RUNNER_H
+#define _RISCV_SLICE_RUNNER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include "cachesim.h"
+
+class sim_t;
+
+// runs a program plainly while forked copies of the simulator run it with
+// instrumentation, a slice of it each, on other host cores.
+//
+// the leader forks a follower where each slice's warmup starts, and when
+// it gets to the end of the slice, hands it what the host sent on the way
+// and how it split up the run, which the follower repeats exactly without
+// a host of its own. in the end the leader stitches together the
+// followers' cache counts, traces and basic block vectors, in order.
+class slice_runner_t
+{
+public:
+  // the caches are counted by the followers only; tracers are what feed
+  // them, and are registered with the followers' processors
+  slice_runner_t(sim_t* sim, const std::vector<memtracer_t*>& tracers,
+                 const std::vector<cache_sim_t*>& caches);
+
+  // what the followers do besides cache simulation
+  void set_trace(bool value) { trace = value; }
+  void set_simpoint(bool enable, size_t interval);
+
+  // run limit instructions, or on to the end with 0, in slices of len
+  // instructions after a warmup of up to warmup of them, with at most
+  // jobs followers running. reports whether every slice got through, and
+  // adds what the followers counted to the caches.
+  bool run(size_t len, size_t warmup, size_t jobs, size_t limit);
+
+private:
+  struct follower_t
+  {
+    pid_t pid;
+    int fd; // both ways: the stretch it is to run, then what it counted
+    size_t slice;
+    size_t first_chunk; // the leader's run() call it was forked before
+    uint64_t host_start; // how far into the recording it was forked
+    bool sent;
+  };
+  struct result_t
+  {
+    bool ok;
+    uint64_t instret;
+    std::vector<cache_sim_t::stats_t> caches;
+  };
+
+  sim_t* sim;
+  std::vector<memtracer_t*> tracers;
+  std::vector<cache_sim_t*> caches;
+  bool trace;
+  bool simpoint;
+  size_t simpoint_interval;
+
+  // the leader's run() calls, and what the host has sent since the
+  // earliest point a follower still waiting was forked at
+  std::vector<size_t> chunks;
+  std::string host_log;
+  uint64_t host_base;
+
+  std::vector<follower_t> followers;
+  std::vector<result_t> results;
+  std::string dir; // where followers write their outputs, one directory each
+
+  std::string slice_dir(size_t slice);
+  void fork_follower(size_t slice, size_t len, size_t warmup);
+  void send(follower_t& f);
+  void wait_follower();
+  void follow(size_t warmup, uint64_t start, int fd);
+  void stitch(size_t nslices);
+};
+
+#endif
@@ -0,0 +1,105 @@
+// See LICENSE for license details.
+
+#include "target_mem.h"
+#include "demand_pager.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+target_mem_t::target_mem_t(size_t size, size_t page_size)
+  : memsz(size), pgsize(page_size), lazy(false), hugepages(false)
+{
+  // MAP_NORESERVE leaves the size unchecked against the host's free
+  // memory, so this normally succeeds at once; shrink it as necessary
+  // otherwise, e.g. under an address space limit
+  size_t quantum = 1L << 20;
+  while ((mem = (char*)mmap(NULL, memsz, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1, 0)) == MAP_FAILED)
+    memsz = memsz*10/11/quantum*quantum;
+
+  written.resize((memsz / pgsize + 63) / 64);
+  dirty.resize(written.size());
+}
+
+target_mem_t::~target_mem_t()
+{
+  pager.reset();
+  munmap(mem, memsz);
+}
+
+void target_mem_t::advise_hugepages()
+{
+  hugepages = true;
+#ifdef MADV_HUGEPAGE
+  if (madvise(mem, memsz, MADV_HUGEPAGE) != 0)
+    perror("madvise(MADV_HUGEPAGE)");
+#else
+  fprintf(stderr, "warning: transparent huge pages are not supported on this host\n");
+#endif
+}
+
+bool target_mem_t::map_file(int fd, off_t offset, size_t len)
+{
+  if (len > memsz)
+    return false;
+  return mmap(mem, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+              fd, offset) != MAP_FAILED;
+}
+
+void target_mem_t::fill_on_demand(const std::vector<page_source_t>& sources)
+{
+  // a fresh mapping is all zero, and has nothing in it to fault on
+  pager.reset();
+  if (mmap(mem, memsz, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+           -1, 0) == MAP_FAILED)
+  {
+    perror("mmap");
+    abort();
+  }
+#ifdef MADV_HUGEPAGE
+  if (hugepages)
+    madvise(mem, memsz, MADV_HUGEPAGE);
+#endif
+  std::fill(written.begin(), written.end(), 0);
+  std::fill(dirty.begin(), dirty.end(), 0);
+
+  std::vector<demand_pager_t::source_t> pages(memsz / pgsize);
+  for (size_t i = 0; i < sources.size(); i++)
+  {
+    pages[sources[i].paddr / pgsize].file = sources[i].file;
+    pages[sources[i].paddr / pgsize].offset = sources[i].offset;
+    mark_written(sources[i].paddr);
+  }
+  pager.reset(new demand_pager_t(mem, memsz, pgsize, std::move(pages)));
+}
+
+void target_mem_t::fill_all()
+{
+  if (pager)
+    pager->fill_all();
+  pager.reset();
+}
+
+bool target_mem_t::is_zero(const char* data, size_t len)
+{
+  // or together whole vectors and only test the result once per chunk;
+  // the compiler maps the vector type onto whatever SIMD the host has
+  typedef uint64_t vec_t __attribute__((vector_size(32)));
+  const size_t CHUNK = 8 * sizeof(vec_t);
+  size_t off = 0;
+  for (; off + CHUNK <= len; off += CHUNK)
+  {
+    vec_t v[8], acc = {0, 0, 0, 0};
+    memcpy(v, data + off, CHUNK);
+    for (size_t i = 0; i < 8; i++)
+      acc |= v[i];
+    if (acc[0] | acc[1] | acc[2] | acc[3])
+      return false;
+  }
+  for (; off < len; off++)
+    if (data[off])
+      return false;
+  return true;
+}
@@ -0,0 +1,111 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_TARGET_MEM_H
+#define _RISCV_TARGET_MEM_H
+
+#include "decode.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+class demand_pager_t;
+
+// the target machine's main memory. all of it is reserved up front, but the
+// host only commits pages as the target writes them, and a bitmap records
+// which pages those are so nothing else has to look at the rest. a second
+// one records the pages written since some point, for delta checkpoints.
+class target_mem_t
+{
+public:
+  // reserve size bytes, or as much less as the host will map. the bitmap
+  // has one bit per page_size bytes.
+  target_mem_t(size_t size, size_t page_size);
+  ~target_mem_t();
+
+  char* data() { return mem; }
+  size_t size() { return memsz; }
+  size_t page_size() { return pgsize; }
+
+  // ask the host to back the memory with transparent huge pages
+  void advise_hugepages();
+
+  // replace the first len bytes of memory with a private, copy-on-write
+  // mapping of the file fd from offset on
+  bool map_file(int fd, off_t offset, size_t len);
+
+  // whether restoring from a checkpoint that can be read a page at a time
+  // should leave each page to be read when first touched
+  void set_lazy(bool value) { lazy = value; }
+  bool is_lazy() { return lazy; }
+
+  // a page to read when first touched: page_size bytes of file from offset
+  struct page_source_t
+  {
+    reg_t paddr;
+    std::string file;
+    off_t offset;
+  };
+
+  // throw away the contents of memory, which reads as zero from now on,
+  // apart from the pages in sources. those are read in as they are touched.
+  void fill_on_demand(const std::vector<page_source_t>& sources);
+
+  // read in whatever fill_on_demand left, e.g. so that a fork gets it all
+  void fill_all();
+
+  // whether the page holding paddr may hold anything but zeros
+  bool page_written(reg_t paddr)
+  {
+    size_t page = paddr / pgsize;
+    return (written[page / 64] >> (page % 64)) & 1;
+  }
+
+  // whether the page holding paddr has been written since clear_dirty
+  bool page_dirty(reg_t paddr)
+  {
+    size_t page = paddr / pgsize;
+    return (dirty[page / 64] >> (page % 64)) & 1;
+  }
+
+  // record a write to the page holding paddr. harts on other threads may
+  // be marking pages in the same word.
+  void mark_written(reg_t paddr)
+  {
+    size_t page = paddr / pgsize;
+    uint64_t bit = uint64_t(1) << (page % 64);
+    if (!(dirty[page / 64] & bit))
+    {
+      __atomic_fetch_or(&written[page / 64], bit, __ATOMIC_RELAXED);
+      __atomic_fetch_or(&dirty[page / 64], bit, __ATOMIC_RELAXED);
+    }
+  }
+
+  // start a new set of dirty pages. anything that skips mark_written for
+  // pages it knows are dirty, like the TLB, must forget that too.
+  void clear_dirty() { std::fill(dirty.begin(), dirty.end(), 0); }
+
+  // whether len bytes at data are all zero
+  static bool is_zero(const char* data, size_t len);
+
+  // whether the page holding paddr holds only zeros
+  bool page_is_zero(reg_t paddr)
+  {
+    return is_zero(mem + paddr / pgsize * pgsize, pgsize);
+  }
+
+private:
+  char* mem;
+  size_t memsz;
+  size_t pgsize;
+  std::vector<uint64_t> written;
+  std::vector<uint64_t> dirty; // a subset of written
+  bool lazy;
+  bool hugepages;
+  std::unique_ptr<demand_pager_t> pager;
+};
+
+#endif
@@ -0,0 +1,124 @@
+// See LICENSE for license details.
+
+#include "insn_template.h"
+#include <unordered_map>
+
+// The threaded dispatcher expands every instruction body inline under its
+// own label. Each basic block caches the label of each of its instructions,
+// so moving to the next instruction costs one indirect jump rather than a
+// call and return through the decoded handler pointer.
+
+#define DECLARE_INSN(name, match, mask) \
+  extern reg_t rv32_##name(processor_t*, insn_t, reg_t); \
+  extern reg_t rv64_##name(processor_t*, insn_t, reg_t);
+#include "encoding.h"
+#undef DECLARE_INSN
+
+template <int xlen>
+void processor_t::step_threaded(reg_t& pc_ref, size_t& instret_ref, size_t n)
+{
+  // handlers that have no label here (extensions, illegal_instruction)
+  // are reached through call_handler instead
+  static const std::unordered_map<insn_func_t, const void*> labels = {
+    #define DECLARE_INSN(name, match, mask) \
+      { xlen == 64 ? rv64_##name : rv32_##name, &&insn_##name },
+    #include "encoding.h"
+    #undef DECLARE_INSN
+  };
+
+  processor_t* p = this;
+  mmu_t* _mmu = mmu;
+  reg_t pc = pc_ref;
+  size_t retired = instret_ref;
+  insn_fetch_t* fetch = NULL;
+  insn_fetch_t* block = NULL;
+  const void* const* target;
+  threaded_fault_label = &&fault_posted;
+
+  try
+  {
+  next_block:
+    // leave the remainder of the budget, any change of xlen, and posted
+    // traps to step()
+    if (unlikely(retired == n) || unlikely(rv64 != (xlen == 64)) ||
+        unlikely(pending_trap != NULL))
+      goto done;
+
+    {
+      bb_cache_entry_t* bb = _mmu->access_bb_cache(pc);
+      if (unlikely(bb->ninsns > n - retired))
+        goto done;
+
+      if (unlikely(!bb->threaded[0]))
+      {
+        for (size_t i = 0; i < bb->ninsns; i++)
+        {
+          auto it = labels.find(bb->data[i].func);
+          bb->threaded[i] = it == labels.end() ? &&call_handler : it->second;
+        }
+        bb->threaded[bb->ninsns] = &&end_block;
+      }
+
+      block = fetch = bb->data;
+      target = bb->threaded;
+      threaded_block = bb;
+      live_instret = retired + bb->ninsns - 1;
+    }
+    goto **target;
+
+    #define THREADED_INSN_BEGIN(name, opcode) \
+      insn_##name: { \
+        insn_t insn = fetch->insn; \
+        reg_t npc = sext_xlen(pc + insn_length(opcode));
+
+    #define THREADED_INSN_END(name) \
+        pc = npc; \
+      } \
+      fetch++; \
+      goto **++target;
+
+    #include "threaded.h"
+
+  call_handler:
+    {
+      reg_t npc = fetch->func(p, fetch->insn, pc);
+      if (insn_faulted()) goto faulted;
+      pc = npc;
+    }
+    fetch++;
+    goto **++target;
+
+  end_block:
+    retired += fetch - block;
+    block = fetch;
+    goto next_block;
+
+  fault_posted:
+    // a load or store faulted, and post_fault sent the rest of the block
+    // here; loads and stores don't jump, so back up over it
+    fetch--;
+    pc = sext_xlen(pc - fetch->insn.length());
+  faulted:
+    // pc is that of the instruction, which has not retired. the block's
+    // labels are looked up again the next time it runs.
+    threaded_block->threaded[0] = NULL;
+    retired += fetch - block;
+    goto done;
+  }
+  catch (...)
+  {
+    threaded_block = NULL;
+    // the faulting instruction has not retired, but those before it have
+    pc_ref = pc;
+    instret_ref = retired + (fetch - block);
+    throw;
+  }
+
+done:
+  threaded_block = NULL;
+  pc_ref = pc;
+  instret_ref = retired;
+}
+
+template void processor_t::step_threaded<32>(reg_t&, size_t&, size_t);
+template void processor_t::step_threaded<64>(reg_t&, size_t&, size_t);
@@ -26,6 +26,7 @@ class mem_trap_t : public trap_t
     : trap_t(which), badvaddr(badvaddr) {}
   void side_effects(state_t* state);
   reg_t get_badvaddr() { return badvaddr; }
+  void set_badvaddr(reg_t value) { badvaddr = value; }
  private:
   reg_t badvaddr;
 };
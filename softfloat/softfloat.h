@@ -41,10 +41,16 @@ these four paragraphs for those parts of this code that are retained.
 
 #include "softfloat_types.h"
 
+/*----------------------------------------------------------------------------
+| The modes and flags below are private to each host thread, so harts that
+| are simulated on separate threads do not see each other's state.
+*----------------------------------------------------------------------------*/
+#define SOFTFLOAT_THREAD_LOCAL __thread
+
 /*----------------------------------------------------------------------------
 | Software floating-point underflow tininess-detection mode.
 *----------------------------------------------------------------------------*/
-extern int_fast8_t softfloat_detectTininess;
+extern SOFTFLOAT_THREAD_LOCAL int_fast8_t softfloat_detectTininess;
 enum {
     softfloat_tininess_beforeRounding = 0,
     softfloat_tininess_afterRounding  = 1
@@ -53,7 +59,7 @@ enum {
 /*----------------------------------------------------------------------------
 | Software floating-point rounding mode.
 *----------------------------------------------------------------------------*/
-extern int_fast8_t softfloat_roundingMode;
+extern SOFTFLOAT_THREAD_LOCAL int_fast8_t softfloat_roundingMode;
 enum {
     softfloat_round_nearest_even   = 0,
     softfloat_round_minMag         = 1,
@@ -65,7 +71,7 @@ enum {
 /*----------------------------------------------------------------------------
 | Software floating-point exception flags.
 *----------------------------------------------------------------------------*/
-extern int_fast8_t softfloat_exceptionFlags;
+extern SOFTFLOAT_THREAD_LOCAL int_fast8_t softfloat_exceptionFlags;
 enum {
     softfloat_flag_inexact   =  1,
     softfloat_flag_underflow =  2,
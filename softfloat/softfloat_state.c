@@ -11,9 +11,9 @@
 | Floating-point rounding mode, extended double-precision rounding precision,
 | and exception flags.
 *----------------------------------------------------------------------------*/
-int_fast8_t softfloat_roundingMode = softfloat_round_nearest_even;
-int_fast8_t softfloat_detectTininess = init_detectTininess;
-int_fast8_t softfloat_exceptionFlags = 0;
+SOFTFLOAT_THREAD_LOCAL int_fast8_t softfloat_roundingMode = softfloat_round_nearest_even;
+SOFTFLOAT_THREAD_LOCAL int_fast8_t softfloat_detectTininess = init_detectTininess;
+SOFTFLOAT_THREAD_LOCAL int_fast8_t softfloat_exceptionFlags = 0;
 
 int_fast8_t floatx80_roundingPrecision = 80;
 
@@ -0,0 +1,25 @@
+// See LICENSE for license details.
+
+// This little program rewrites a compressed checkpoint, dense or sparse,
+// as a raw checkpoint, which spike -f restores by mapping its memory image
+// rather than inflating it.
+
+#include "sim.h"
+#include <cstdio>
+#include <string>
+
+int main(int argc, char** argv)
+{
+  if (argc != 3)
+  {
+    fprintf(stderr, "usage: spike-ckpt2raw <checkpoint.gz> <checkpoint.raw>\n");
+    return 1;
+  }
+
+  if (!sim_t::convert_checkpoint(argv[1], argv[2]))
+  {
+    fprintf(stderr, "spike-ckpt2raw: could not convert %s to %s\n", argv[1], argv[2]);
+    return 1;
+  }
+  return 0;
+}
@@ -5,10 +5,16 @@
 #include "cachesim.h"
 #include "extension.h"
 #include "ckpt_desc_reader.h"
+#include "region_runner.h"
+#include "fork_server.h"
+#include "slice_runner.h"
+#include "access_queue.h"
+#include "jit.h"
 #include <dlfcn.h>
 #include <fesvr/option_parser.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <vector>
 #include <string>
@@ -24,6 +30,7 @@ static void help()
   fprintf(stderr, "  -m<n>              Provide <n> MB of target memory\n");
   fprintf(stderr, "  -d                 Interactive debug mode\n");
   fprintf(stderr, "  -g                 Track histogram of PCs\n");
+  fprintf(stderr, "  -l                 Print the commit log of each instruction to stderr\n");
   fprintf(stderr, "  -s <Interval>      Dump basic block vector profile for Simpoint with specified interval\n");
   fprintf(stderr, "  -t<n> / -t<s>,<n>    Trace the simulation to file trace_proc_[coreid].gz\n");
   fprintf(stderr, "                       If <s> is given, will skip <s> instructions prior to tracing\n");
@@ -33,8 +40,44 @@ static void help()
   fprintf(stderr, "  --ic=<S>:<W>:<B>   Instantiate a cache model with S sets,\n");
   fprintf(stderr, "  --dc=<S>:<W>:<B>     W ways, and B-byte blocks (with S and\n");
   fprintf(stderr, "  --l2=<S>:<W>:<B>     B both powers of 2).\n");
+  fprintf(stderr, "  --cache-thread     Simulate the caches on a host thread of their own, fed\n");
+  fprintf(stderr, "                       through a queue of memory accesses\n");
   fprintf(stderr, "  --extension=<name> Specify RoCC Extension\n");
   fprintf(stderr, "  --extlib=<name>    Shared library to load\n");
+  fprintf(stderr, "  --dispatch=<name>  Instruction dispatch: loop (default), threaded or jit\n");
+  fprintf(stderr, "  --ckpt-format=<f>  Checkpoint memory as dense (default) or sparse, or as raw:\n");
+  fprintf(stderr, "                       uncompressed, and restored by mapping it into memory\n");
+  fprintf(stderr, "  --ckpt-delta       With -c, write each checkpoint after the first as just the\n");
+  fprintf(stderr, "                       pages changed since the one before it\n");
+  fprintf(stderr, "  --ckpt-store=<dir> Keep checkpointed memory pages in <dir>, once for all the\n");
+  fprintf(stderr, "                       checkpoints using it; each checkpoint just lists\n");
+  fprintf(stderr, "                       its pages by hash\n");
+  fprintf(stderr, "  --ckpt-jobs=<n>    With -c, write up to <n> checkpoints at once from forked\n");
+  fprintf(stderr, "                       copies of the simulator while it runs on\n");
+  fprintf(stderr, "  --regions=<file>   With -e <n>, run <n> instructions from each checkpoint listed\n");
+  fprintf(stderr, "                       in <file> as \"<checkpoint>: <weight>\", and sum up by weight\n");
+  fprintf(stderr, "  --region-jobs=<n>  Run up to <n> regions at once [default all host threads]\n");
+  fprintf(stderr, "  --serve=<socket>   Run each job sent to Unix socket <socket> as a line of\n");
+  fprintf(stderr, "                       \"[-e <n>] [-t <seconds>] <args>\" in a forked simulator,\n");
+  fprintf(stderr, "                       with <args> after the host arguments given here, if any\n");
+  fprintf(stderr, "  --serve-jobs=<n>   Run up to <n> jobs at once [default all host threads]\n");
+  fprintf(stderr, "  --slices=<n>       Run plainly, forking copies that run each <n> instructions\n");
+  fprintf(stderr, "                       with the cache models, -s and -t, and stitch up their outputs\n");
+  fprintf(stderr, "  --slice-warmup=<n> Warm up the caches for <n> instructions before each slice\n");
+  fprintf(stderr, "  --slice-jobs=<n>   Run up to <n> slices at once [default all host threads]\n");
+  fprintf(stderr, "  --boot-cache=<dir> Start from a snapshot in <dir> taken where the program first\n");
+  fprintf(stderr, "                       enters user mode, taking it on the first run (not with -c, -f\n");
+  fprintf(stderr, "                       or -p more than 1)\n");
+  fprintf(stderr, "  --lazy-restore     With -f and a checkpoint in a page store, read each page\n");
+  fprintf(stderr, "                       only when the target first touches it\n");
+  fprintf(stderr, "  --hugepages        Back target memory with transparent huge pages\n");
+  fprintf(stderr, "  --parallel=<n>     Run each processor on its own host thread, synchronizing\n");
+  fprintf(stderr, "                       every <n> instructions (not with -c, -e, -t<s>,<n>,\n");
+  fprintf(stderr, "                       --regions or --slices)\n");
+  fprintf(stderr, "  --deterministic    With --parallel, interleave the processors exactly as\n");
+  fprintf(stderr, "                       a single-threaded run does\n");
+  fprintf(stderr, "  --shared-decode    Share decoded instructions between processors running the\n");
+  fprintf(stderr, "                       same physical pages\n");
   exit(1);
 }
 
@@ -56,15 +99,35 @@ int main(int argc, char** argv)
 {
   bool debug = false;
   bool histogram = false;
+  bool commit_log = false;
+  dispatch_t dispatch = DISPATCH_LOOP;
   bool simpoint = false;
   size_t simpoint_interval = 100000000;
   bool checkpoint = false;
   size_t checkpoint_skip_amt = 0;
   size_t nprocs = 1;
   size_t mem_mb = 0;
+  ckpt_format_t ckpt_format = CKPT_DENSE;
+  bool ckpt_delta = false;
+  std::string ckpt_store;
+  size_t ckpt_jobs = 0;
+  std::string regions_file;
+  size_t region_jobs = std::thread::hardware_concurrency();
+  std::string boot_cache;
+  size_t slice_len = 0;
+  size_t slice_warmup = 0;
+  size_t slice_jobs = std::thread::hardware_concurrency();
+  std::string serve_socket;
+  size_t serve_jobs = std::thread::hardware_concurrency();
+  bool lazy_restore = false;
+  bool hugepages = false;
+  size_t parallel_quantum = 0;
+  bool deterministic = false;
+  bool shared_decode = false;
   std::unique_ptr<icache_sim_t> ic;
   std::unique_ptr<dcache_sim_t> dc;
   std::unique_ptr<cache_sim_t> l2;
+  bool cache_thread = false;
   std::function<extension_t*()> extension;
 
   bool trace = false;
@@ -80,6 +143,7 @@ int main(int argc, char** argv)
   parser.option('h', 0, 0, [&](const char* s){help();});
   parser.option('d', 0, 0, [&](const char* s){debug = true;});
   parser.option('g', 0, 0, [&](const char* s){histogram = true;});
+  parser.option('l', 0, 0, [&](const char* s){commit_log = true;});
   parser.option('s', 0, 1, [&](const char* s){simpoint = true; simpoint_interval = atol(s);});
   parser.option('p', 0, 1, [&](const char* s){nprocs = atoi(s);});
   parser.option('m', 0, 1, [&](const char* s){mem_mb = atoi(s);});
@@ -103,6 +167,7 @@ int main(int argc, char** argv)
   parser.option(0, "ic", 1, [&](const char* s){ic.reset(new icache_sim_t(s));});
   parser.option(0, "dc", 1, [&](const char* s){dc.reset(new dcache_sim_t(s));});
   parser.option(0, "l2", 1, [&](const char* s){l2.reset(cache_sim_t::construct(s, "L2$"));});
+  parser.option(0, "cache-thread", 0, [&](const char* s){cache_thread = true;});
   parser.option(0, "extension", 1, [&](const char* s){extension = find_extension(s);});
   parser.option(0, "extlib", 1, [&](const char *s){
     void *lib = dlopen(s, RTLD_NOW | RTLD_GLOBAL);
@@ -112,44 +177,138 @@ int main(int argc, char** argv)
     }
   });
 
+  parser.option(0, "dispatch", 1, [&](const char* s){
+    if (!strcmp(s, "loop"))
+      dispatch = DISPATCH_LOOP;
+    else if (!strcmp(s, "threaded"))
+      dispatch = DISPATCH_THREADED;
+    else if (!strcmp(s, "jit") && jit_t::supported())
+      dispatch = DISPATCH_JIT;
+    else {
+      fprintf(stderr, "Unsupported dispatch mode '%s'\n", s);
+      exit(-1);
+    }
+  });
+
+  parser.option(0, "ckpt-format", 1, [&](const char* s){
+    if (!strcmp(s, "sparse"))
+      ckpt_format = CKPT_SPARSE;
+    else if (!strcmp(s, "dense"))
+      ckpt_format = CKPT_DENSE;
+    else if (!strcmp(s, "raw"))
+      ckpt_format = CKPT_RAW;
+    else {
+      fprintf(stderr, "Unsupported checkpoint format '%s'\n", s);
+      exit(-1);
+    }
+  });
+  parser.option(0, "ckpt-delta", 0, [&](const char* s){ckpt_delta = true;});
+  parser.option(0, "ckpt-store", 1, [&](const char* s){ckpt_store = s;});
+  parser.option(0, "ckpt-jobs", 1, [&](const char* s){ckpt_jobs = atol(s);});
+  parser.option(0, "regions", 1, [&](const char* s){regions_file = s;});
+  parser.option(0, "region-jobs", 1, [&](const char* s){region_jobs = atol(s);});
+  parser.option(0, "serve", 1, [&](const char* s){serve_socket = s;});
+  parser.option(0, "serve-jobs", 1, [&](const char* s){serve_jobs = atol(s);});
+  parser.option(0, "slices", 1, [&](const char* s){slice_len = atol(s);});
+  parser.option(0, "slice-warmup", 1, [&](const char* s){slice_warmup = atol(s);});
+  parser.option(0, "slice-jobs", 1, [&](const char* s){slice_jobs = atol(s);});
+  parser.option(0, "boot-cache", 1, [&](const char* s){boot_cache = s;});
+  parser.option(0, "lazy-restore", 0, [&](const char* s){lazy_restore = true;});
+  parser.option(0, "hugepages", 0, [&](const char* s){hugepages = true;});
+  parser.option(0, "parallel", 1, [&](const char* s){parallel_quantum = atol(s);});
+  parser.option(0, "deterministic", 0, [&](const char* s){deterministic = true;});
+  parser.option(0, "shared-decode", 0, [&](const char* s){shared_decode = true;});
+
   auto argv1 = parser.parse(argv);
-  if (!*argv1)
+  if (!*argv1 && serve_socket.empty())
     help();
   std::vector<std::string> htif_args(argv1, (const char*const*)argv + argc);
-  sim_t s(nprocs, mem_mb, htif_args);
+  // a server's simulator gets a host for each job
+  sim_t s(nprocs, mem_mb, serve_socket.empty() ? htif_args : std::vector<std::string>());
 
   if (ic && l2) ic->set_miss_handler(&*l2);
   if (dc && l2) dc->set_miss_handler(&*l2);
+  // destroyed before the caches, so they have seen everything by the time
+  // they print their counts
+  std::unique_ptr<access_queue_t> cache_queue;
+  if (cache_thread && (ic || dc) && !slice_len)
+  {
+    cache_queue.reset(new access_queue_t);
+    if (ic) cache_queue->hook(&*ic);
+    if (dc) cache_queue->hook(&*dc);
+  }
+  // with --slices only the followers simulate the caches
   for (size_t i = 0; i < nprocs; i++)
   {
-    if (ic) s.get_core(i)->get_mmu()->register_memtracer(&*ic);
-    if (dc) s.get_core(i)->get_mmu()->register_memtracer(&*dc);
+    if (cache_queue) s.get_core(i)->get_mmu()->register_memtracer(&*cache_queue);
+    if (ic && !slice_len && !cache_queue) s.get_core(i)->get_mmu()->register_memtracer(&*ic);
+    if (dc && !slice_len && !cache_queue) s.get_core(i)->get_mmu()->register_memtracer(&*dc);
     if (extension) s.get_core(i)->register_extension(extension());
   }
 
   s.set_debug(debug);
   s.set_histogram(histogram);
+  s.set_commit_log(commit_log);
+  s.set_dispatch(dispatch);
+  s.set_hugepages(hugepages);
+  s.set_checkpoint_format(ckpt_format);
+  s.set_checkpoint_delta(ckpt_delta);
+  s.set_checkpoint_store(ckpt_store);
+  s.set_checkpoint_jobs(ckpt_jobs);
+  s.set_lazy_restore(lazy_restore);
+  s.set_boot_cache(boot_cache);
+  s.set_simpoint(simpoint && !slice_len, simpoint_interval);
+  s.set_parallel(parallel_quantum, deterministic);
+  s.set_shared_decode(shared_decode);
+
+  if (trace && checkpoint) {
+    fprintf(stderr, "Doesn't support tracing and checkpointing together.\n");
+    exit(-1);
+  }
 
-#ifdef RISCV_ENABLE_SIMPOINT
-  s.set_simpoint(simpoint, simpoint_interval);
-#else
-  if(simpoint){
-    fprintf(stderr, "Spike wasn't compiled with Simpoint support.\n");
+  if (!ckpt_store.empty() && (ckpt_delta || ckpt_format != CKPT_DENSE)) {
+    fprintf(stderr, "--ckpt-store doesn't combine with --ckpt-delta or --ckpt-format.\n");
     exit(-1);
   }
-#endif
 
-#ifndef RISCV_ENABLE_DBG_TRACE
-  if(trace) {
-    fprintf(stderr, "Spike wasn't compiled with tracing support.\n");
+  // a snapshot holds the registers of just one processor, as a checkpoint does
+  if (!boot_cache.empty() && nprocs > 1) {
+    fprintf(stderr, "--boot-cache doesn't combine with -p more than 1.\n");
     exit(-1);
   }
-#else
-  if (trace && checkpoint) {
-    fprintf(stderr, "Doesn't support tracing and checkpointing together.\n");
+
+  // checkpoints replay the host from the end of the boot tick on
+  if (!boot_cache.empty() && (checkpoint || !checkpoint_file.empty() || !regions_file.empty())) {
+    fprintf(stderr, "--boot-cache doesn't combine with -c, -f or --regions.\n");
+    exit(-1);
+  }
+
+  if (slice_len && (checkpoint || !regions_file.empty() || !serve_socket.empty() ||
+                    debug || histogram || commit_log || lazy_restore ||
+                    (trace && (trace_skip_amt || trace_last_n)))) {
+    fprintf(stderr, "--slices doesn't combine with -c, -d, -g, -l, --regions, --serve, --lazy-restore\n"
+                    "or -t other than -t 0.\n");
+    exit(-1);
+  }
+
+  // forked copies of the simulator would have no thread to drain the queue
+  if (cache_thread && (slice_len || !regions_file.empty() || !serve_socket.empty())) {
+    fprintf(stderr, "--cache-thread doesn't combine with --slices, --regions or --serve.\n");
+    exit(-1);
+  }
+
+  // only sim_t::run() gives the processors threads of their own; counting
+  // out instructions with run(n) steps them in turn
+  if (parallel_quantum && (stop_amt != NO_STOP || checkpoint || trace_skip_amt ||
+                           !regions_file.empty() || slice_len)) {
+    fprintf(stderr, "--parallel doesn't combine with -c, -e, -t<s>,<n>, --regions or --slices.\n");
+    exit(-1);
+  }
+
+  if (parallel_quantum && !deterministic && (ic || dc)) {
+    fprintf(stderr, "Cache models are shared by all processors, so --ic and --dc need --deterministic with --parallel.\n");
     exit(-1);
   }
-#endif
 
   int htif_code = true;
 
@@ -158,6 +317,40 @@ int main(int argc, char** argv)
     checkpoint_file = "checkpoint_"+std::to_string(checkpoint_skip_amt);
   }
 
+  if (!serve_socket.empty()) { // Runs jobs from a socket
+    if (checkpoint || trace || !checkpoint_file.empty() || !regions_file.empty()) {
+      fprintf(stderr, "--serve doesn't combine with -c, -f, -t or --regions.\n");
+      exit(-1);
+    }
+    fork_server_t server(&s, htif_args, stop_amt == NO_STOP ? 0 : stop_amt);
+    return server.serve(serve_socket, serve_jobs) ? 0 : -1;
+  }
+
+  if (!regions_file.empty()) { // Runs the regions of a SimPoint analysis
+    if (stop_amt == NO_STOP || checkpoint || trace || !checkpoint_file.empty()) {
+      fprintf(stderr, "--regions needs -e for the length of each region, and no -c, -f or -t.\n");
+      exit(-1);
+    }
+    region_list regions;
+    try {
+      regions = region_file_read(regions_file);
+    } catch (std::runtime_error &ex) {
+      std::cout << "Fail to load region file, reason:\n" << ex.what() << std::endl;
+      exit(-1);
+    }
+
+    std::vector<cache_sim_t*> caches;
+    if (ic) caches.push_back(ic->get_cache());
+    if (dc) caches.push_back(dc->get_cache());
+    if (l2) caches.push_back(&*l2);
+
+    // every worker boots a copy of the simulator on its own
+    region_runner_t runner(&s, caches);
+    bool ok = runner.run(regions, stop_amt, region_jobs);
+    runner.print_summary();
+    return ok ? 0 : -1;
+  }
+
   // Initialize the processor before dumping/restoring checkpoint
   s.boot();
 
@@ -192,6 +385,9 @@ int main(int argc, char** argv)
       amt_ran += step;
     }
 
+    // checkpoints written in the background have to be done before exiting
+    if (!s.wait_checkpoints())
+      return -1;
     return 0;
   } else { // Run Spike in normal mode
     if (!checkpoint_file.empty()) { // Starting from a checkpoint?
@@ -199,7 +395,21 @@ int main(int argc, char** argv)
       s.restore_checkpoint(checkpoint_file);
     }
 
-#ifdef RISCV_ENABLE_DBG_TRACE
+    if (slice_len) { // Runs the instrumentation in slices, on forked followers
+      std::vector<memtracer_t*> tracers;
+      std::vector<cache_sim_t*> caches;
+      if (ic) tracers.push_back(&*ic), caches.push_back(ic->get_cache());
+      if (dc) tracers.push_back(&*dc), caches.push_back(dc->get_cache());
+      if (l2) caches.push_back(&*l2);
+
+      slice_runner_t slicer(&s, tracers, caches);
+      slicer.set_trace(trace);
+      slicer.set_simpoint(simpoint, simpoint_interval);
+      bool ok = slicer.run(slice_len, slice_warmup, slice_jobs,
+                           stop_amt == NO_STOP ? 0 : stop_amt);
+      return ok ? 0 : -1;
+    }
+
     if (trace) { // trace enabled?
       if (trace_skip_amt) {
         if (stop_amt != NO_STOP) {
@@ -220,7 +430,6 @@ int main(int argc, char** argv)
         return htif_code;
       }
     }
-#endif
     if (stop_amt == NO_STOP) {
       htif_code = s.run();
     } else {